@@ -22,6 +22,8 @@ struct cluster_cmd_data {
 	int copies;
 	int nohalt;
 	int force;
+	int adaptive;
+	int placement;
 	char name[STORE_LEN];
 } cluster_cmd_data;
 
@@ -90,6 +92,7 @@ static int cluster_format(int argc, char **argv)
 	hdr.copies = cluster_cmd_data.copies;
 	if (cluster_cmd_data.nohalt)
 		set_nohalt(&hdr.flags);
+	hdr.flags |= cluster_cmd_data.placement << SD_FLAG_PLACEMENT_SHIFT;
 	hdr.epoch = sd_epoch;
 	hdr.ctime = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
 
@@ -458,10 +461,107 @@ static int cluster_recover(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int cluster_throttle(int argc, char **argv)
+{
+	int fd, ret;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct recovery_throttle rt = { 0 };
+	unsigned rlen, wlen;
+	char *p;
+
+	if (!argv[optind]) {
+		fprintf(stderr, "Please specify the recovery rate\n");
+		return EXIT_USAGE;
+	}
+	rt.max_rate = strtoul(argv[optind], &p, 10);
+	if (argv[optind] == p || *p) {
+		fprintf(stderr, "Invalid rate '%s'\n", argv[optind]);
+		return EXIT_USAGE;
+	}
+	rt.adaptive = cluster_cmd_data.adaptive;
+	if (rt.adaptive && !rt.max_rate) {
+		fprintf(stderr, "Adaptive mode needs a rate limit\n");
+		return EXIT_USAGE;
+	}
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_SYSFAIL;
+
+	sd_init_req(&hdr, SD_OP_SET_RECOVERY);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(rt);
+
+	rlen = 0;
+	wlen = sizeof(rt);
+	ret = exec_req(fd, &hdr, &rt, &wlen, &rlen);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		return EXIT_SYSFAIL;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Setting the recovery rate failed: %s\n",
+				sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int cluster_reclaim(int argc, char **argv)
+{
+	int fd, ret;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	unsigned rlen, wlen;
+	uint32_t rate;
+	char *p;
+
+	if (!argv[optind]) {
+		fprintf(stderr, "Please specify the deletion rate\n");
+		return EXIT_USAGE;
+	}
+	rate = strtoul(argv[optind], &p, 10);
+	if (argv[optind] == p || *p) {
+		fprintf(stderr, "Invalid rate '%s'\n", argv[optind]);
+		return EXIT_USAGE;
+	}
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_SYSFAIL;
+
+	sd_init_req(&hdr, SD_OP_SET_DELETION);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(rate);
+
+	rlen = 0;
+	wlen = sizeof(rate);
+	ret = exec_req(fd, &hdr, &rate, &wlen, &rlen);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		return EXIT_SYSFAIL;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Setting the deletion rate failed: %s\n",
+				sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprh", "show cluster information",
 	 SUBCMD_FLAG_NEED_NODELIST, cluster_info},
-	{"format", NULL, "bcHaph", "create a Sheepdog store",
+	{"format", NULL, "bcHLaph", "create a Sheepdog store",
 	 0, cluster_format},
 	{"shutdown", NULL, "aph", "stop Sheepdog",
 	 SUBCMD_FLAG_NEED_NODELIST, cluster_shutdown},
@@ -471,6 +571,11 @@ static struct subcommand cluster_cmd[] = {
 	0, cluster_snapshot},
 	{"cleanup", NULL, "aph", "cleanup the useless snapshot data from recovery",
 	0, cluster_cleanup},
+	{"throttle", "<MB/s>", "Aaph", "limit the recovery bandwidth (0 for no limit)",
+	0, cluster_throttle},
+	{"reclaim", "<objects/s>", "aph",
+	 "limit the removal rate of deleted VDI objects (0 for no limit)",
+	 0, cluster_reclaim},
 	{NULL,},
 };
 
@@ -498,6 +603,17 @@ static int cluster_parser(int ch, char *opt)
 	case 'H':
 		cluster_cmd_data.nohalt = 1;
 		break;
+	case 'L':
+		if (!strcmp(opt, "ring"))
+			cluster_cmd_data.placement = SD_PLACEMENT_RING;
+		else if (!strcmp(opt, "straw2"))
+			cluster_cmd_data.placement = SD_PLACEMENT_STRAW2;
+		else {
+			fprintf(stderr, "Unknown placement '%s': "
+				"must be ring or straw2\n", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
 	case 'f':
 		cluster_cmd_data.force = 1;
 		break;
@@ -515,6 +631,9 @@ static int cluster_parser(int ch, char *opt)
 	case 'l':
 		cluster_cmd_data.list = 1;
 		break;
+	case 'A':
+		cluster_cmd_data.adaptive = 1;
+		break;
 	}
 
 	return 0;
@@ -38,15 +38,18 @@ static const struct sd_option collie_options[] = {
 	{'s', "snapshot", 1, "specify a snapshot id or tag name"},
 	{'x', "exclusive", 0, "write in an exclusive mode"},
 	{'d', "delete", 0, "delete a key"},
+	{'t', "rate", 1, "limit the number of objects copied per second"},
 
 	/* cluster options */
 	{'b', "store", 1, "specify backend store"},
 	{'c', "copies", 1, "specify the data redundancy (number of copies)"},
 	{'H', "nohalt", 0, "serve IO requests even if there are too few\n\
                           nodes for the configured redundancy"},
+	{'L', "placement", 1, "specify the object placement (ring or straw2)"},
 	{'f', "force", 0, "do not prompt for confirmation"},
 	{'R', "restore", 1, "restore the cluster"},
 	{'l', "list", 0, "list the user epoch information"},
+	{'A', "adaptive", 0, "back off while guest I/O is queueing"},
 
 	{ 0, NULL, 0, NULL },
 };
@@ -56,9 +59,10 @@ static void usage(struct command *commands, int status);
 uint32_t sd_epoch;
 
 struct sd_node sd_nodes[SD_MAX_NODES];
-struct sd_vnode sd_vnodes[SD_MAX_VNODES];
+struct sd_vnode *sd_vnodes;
 int sd_nodes_nr, sd_vnodes_nr;
 unsigned master_idx;
+int sd_placement_id;
 
 static int update_node_list(int max_nodes, uint32_t epoch)
 {
@@ -113,9 +117,13 @@ static int update_node_list(int max_nodes, uint32_t epoch)
 	}
 
 	memcpy(sd_nodes, buf, size);
+	/* with -v auto, the number of vnodes has no fixed upper bound */
+	sd_vnodes = xrealloc(sd_vnodes, sizeof(*sd_vnodes) *
+			     nodes_to_vnodes(sd_nodes, sd_nodes_nr, NULL));
 	sd_vnodes_nr = nodes_to_vnodes(sd_nodes, sd_nodes_nr, sd_vnodes);
 	sd_epoch = hdr.epoch;
 	master_idx = rsp->master_idx;
+	sd_placement_id = sd_placement(rsp->flags);
 out:
 	if (buf)
 		free(buf);
@@ -125,6 +133,35 @@ out:
 	return ret;
 }
 
+/* Locate the copies of oid with the placement algorithm of the cluster */
+void collie_obj_to_sheeps(struct sd_node *nodes, int nr_nodes,
+			  struct sd_vnode *vnodes, int nr_vnodes,
+			  uint64_t oid, int nr_copies, int *idxs)
+{
+	int i, j;
+
+	if (sd_placement_id != SD_PLACEMENT_STRAW2) {
+		obj_to_sheeps(vnodes, nr_vnodes, oid, nr_copies, idxs);
+		return;
+	}
+
+	if (obj_to_nodes_straw2(nodes, nr_nodes, oid, nr_copies,
+				idxs) < nr_copies) {
+		fprintf(stderr, "There are too few zones for %d copies\n",
+			nr_copies);
+		exit(EXIT_SYSFAIL);
+	}
+
+	for (i = 0; i < nr_copies; i++) {
+		for (j = 0; j < nr_vnodes; j++) {
+			if (!memcmp(&vnodes[j].nid, &nodes[idxs[i]].nid,
+				    sizeof(vnodes[j].nid)))
+				break;
+		}
+		idxs[i] = j;
+	}
+}
+
 static int (*command_parser)(int, char *);
 static int (*command_fn)(int, char **);
 static const char *command_options;
@@ -57,10 +57,14 @@ extern int raw_output;
 
 extern uint32_t sd_epoch;
 extern struct sd_node sd_nodes[SD_MAX_NODES];
-extern struct sd_vnode sd_vnodes[SD_MAX_VNODES];
+extern struct sd_vnode *sd_vnodes;
 extern int sd_nodes_nr, sd_vnodes_nr;
 extern unsigned master_idx;
+extern int sd_placement_id;
 
+void collie_obj_to_sheeps(struct sd_node *nodes, int nr_nodes,
+			  struct sd_vnode *vnodes, int nr_vnodes,
+			  uint64_t oid, int nr_copies, int *idxs);
 int is_current(struct sheepdog_inode *i);
 char *size_to_str(uint64_t _size, char *str, int str_size);
 typedef void (*vdi_parser_func_t)(uint32_t vid, char *name, char *tag,
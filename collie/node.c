@@ -116,45 +116,129 @@ static int node_info(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static char *secs_to_str(uint64_t secs, char *str, int str_size)
+{
+	if (secs >= 3600)
+		snprintf(str, str_size, "%"PRIu64"h%02"PRIu64"m",
+			 secs / 3600, secs / 60 % 60);
+	else
+		snprintf(str, str_size, "%"PRIu64"m%02"PRIu64"s",
+			 secs / 60, secs % 60);
+	return str;
+}
+
+#define RECOVERY_STAT_LEN (sizeof(struct recovery_stat) +		\
+			   SD_MAX_NODES * sizeof(struct recovery_source_stat) + \
+			   SD_RECOVERY_HISTORY * sizeof(struct recovery_history))
+
+static void print_recovery_detail(int idx, struct recovery_stat *st)
+{
+	struct recovery_source_stat *src = (void *)(st + 1);
+	struct recovery_history *h = (void *)(src + st->nr_sources);
+	char host[128], size[21], elapsed[32];
+	int i;
+
+	if (st->nr_sources)
+		printf("\nNode %d copied from:\n"
+		       "  Host:Port             Objects     Size\n", idx);
+	for (i = 0; i < st->nr_sources; i++) {
+		addr_to_str(host, sizeof(host), src[i].nid.addr,
+			    src[i].nid.port);
+		printf("  %-20s%10"PRIu64"%9s\n", host, src[i].nr_objs,
+		       size_to_str(src[i].bytes, size, sizeof(size)));
+	}
+
+	if (st->nr_history)
+		printf("\nNode %d recent recoveries:\n"
+		       "  Epoch    Objects   Failed     Copied    Time\n", idx);
+	for (i = 0; i < st->nr_history; i++)
+		printf("  %5u%11"PRIu64"%9"PRIu64"%11s%8s%s\n", h[i].epoch,
+		       h[i].nr_done, h[i].nr_failed,
+		       size_to_str(h[i].bytes, size, sizeof(size)),
+		       secs_to_str(h[i].elapsed, elapsed, sizeof(elapsed)),
+		       h[i].completed ? "" : "  (superseded)");
+}
+
 static int node_recovery(int argc, char **argv)
 {
 	int i, ret;
+	struct recovery_stat **stats;
+
+	stats = xzalloc(sd_nodes_nr * sizeof(*stats));
 
 	if (!raw_output) {
 		printf("Nodes In Recovery:\n");
-		printf("  Id   Host:Port         V-Nodes       Zone\n");
+		printf("  Id   Host:Port         V-Nodes       Zone  Epoch"
+		       "      Done/Total  Failed    Copied      Rate      ETA\n");
 	}
 
 	for (i = 0; i < sd_nodes_nr; i++) {
-		char host[128];
+		char host[128], progress[48], size[21], rate[21], eta[32];
 		int fd;
 		unsigned wlen, rlen;
 		struct sd_node_req req;
 		struct sd_node_rsp *rsp = (struct sd_node_rsp *)&req;
+		struct recovery_stat *st;
 
 		addr_to_str(host, sizeof(host), sd_nodes[i].nid.addr, 0);
 
 		fd = connect_to(host, sd_nodes[i].nid.port);
-		if (fd < 0)
-			return EXIT_FAILURE;
+		if (fd < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		st = stats[i] = xzalloc(RECOVERY_STAT_LEN);
 
 		sd_init_req((struct sd_req *)&req, SD_OP_STAT_RECOVERY);
+		req.data_length = RECOVERY_STAT_LEN;
 
 		wlen = 0;
-		rlen = 0;
-		ret = exec_req(fd, (struct sd_req *)&req, NULL, &wlen, &rlen);
+		rlen = RECOVERY_STAT_LEN;
+		ret = exec_req(fd, (struct sd_req *)&req, st, &wlen, &rlen);
 		close(fd);
 
-		if (!ret && rsp->result == SD_RES_SUCCESS) {
-			addr_to_str(host, sizeof(host),
-					sd_nodes[i].nid.addr, sd_nodes[i].nid.port);
-			printf(raw_output ? "%d %s %d %d\n" : "%4d   %-20s%5d%11d\n",
-				   i, host, sd_nodes[i].nr_vnodes,
-				   sd_nodes[i].zone);
-		}
+		if (ret || rsp->result != SD_RES_SUCCESS)
+			continue;
+
+		/* a sheep without statistics only tells it is recovering */
+		if (rsp->data_length < sizeof(*st))
+			memset(st, 0, sizeof(*st));
+		else if (!st->epoch)
+			continue;
+
+		addr_to_str(host, sizeof(host),
+				sd_nodes[i].nid.addr, sd_nodes[i].nid.port);
+		if (st->preparing)
+			snprintf(progress, sizeof(progress), "preparing");
+		else
+			snprintf(progress, sizeof(progress),
+				 "%"PRIu64"/%"PRIu64, st->nr_done,
+				 st->nr_total);
+		size_to_str(st->bytes, size, sizeof(size));
+		size_to_str(st->rate, rate, sizeof(rate));
+		if (st->eta)
+			secs_to_str(st->eta, eta, sizeof(eta));
+		else
+			snprintf(eta, sizeof(eta), "-");
+
+		printf(raw_output ? "%d %s %d %d %u %s %"PRIu64" %s %s %s\n" :
+		       "%4d   %-20s%5d%11d%7u%16s%8"PRIu64"%10s%8s/s%9s\n",
+		       i, host, sd_nodes[i].nr_vnodes, sd_nodes[i].zone,
+		       st->epoch, progress, st->nr_failed, size, rate, eta);
 	}
 
-	return EXIT_SUCCESS;
+	if (!raw_output)
+		for (i = 0; i < sd_nodes_nr; i++)
+			if (stats[i])
+				print_recovery_detail(i, stats[i]);
+
+	ret = EXIT_SUCCESS;
+out:
+	for (i = 0; i < sd_nodes_nr; i++)
+		free(stats[i]);
+	free(stats);
+	return ret;
 }
 
 static struct subcommand node_cmd[] = {
@@ -162,7 +246,7 @@ static struct subcommand node_cmd[] = {
 	 SUBCMD_FLAG_NEED_NODELIST, node_list},
 	{"info", NULL, "aprh", "show information about each node",
 	 SUBCMD_FLAG_NEED_NODELIST, node_info},
-	{"recovery", NULL, "aprh", "show nodes in recovery",
+	{"recovery", NULL, "aprh", "show recovery progress of each node",
 	 SUBCMD_FLAG_NEED_NODELIST, node_recovery},
 	{NULL,},
 };
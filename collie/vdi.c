@@ -23,6 +23,7 @@ struct vdi_cmd_data {
 	int exclusive;
 	int delete;
 	int prealloc;
+	unsigned int rate;
 } vdi_cmd_data = { ~0, };
 
 struct get_vdi_info {
@@ -799,7 +800,7 @@ static int print_obj_epoch(uint64_t oid)
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	unsigned rlen, wlen;
-	struct sd_vnode vnodes[SD_MAX_VNODES];
+	struct sd_vnode *vnodes = NULL;
 	int idx_buf[SD_MAX_COPIES];
 	struct epoch_log *logs;
 	int vnodes_nr, nr_logs, log_length;
@@ -838,12 +839,16 @@ again:
 
 	nr_logs = rsp->data_length / sizeof(struct epoch_log);
 	for (i = nr_logs - 1; i >= 0; i--) {
-		vnodes_nr = nodes_to_vnodes(logs[i].nodes, logs[i].nr_nodes, vnodes);
+		vnodes_nr = nodes_to_vnodes(logs[i].nodes, logs[i].nr_nodes,
+					    NULL);
+		vnodes = xrealloc(vnodes, sizeof(*vnodes) * vnodes_nr);
+		nodes_to_vnodes(logs[i].nodes, logs[i].nr_nodes, vnodes);
 		printf("\nobj %"PRIx64" locations at epoch %d, copies = %d\n",
 		       oid, logs[i].epoch, logs[i].nr_copies);
 		printf("---------------------------------------------------\n");
-		obj_to_sheeps(vnodes, vnodes_nr, oid,
-			      logs[i].nr_copies, idx_buf);
+		collie_obj_to_sheeps(logs[i].nodes, logs[i].nr_nodes,
+				     vnodes, vnodes_nr, oid,
+				     logs[i].nr_copies, idx_buf);
 		for (j = 0; j < logs[i].nr_copies; j++) {
 			idx = idx_buf[j];
 			addr_to_str(host, sizeof(host), vnodes[idx].nid.addr,
@@ -852,6 +857,7 @@ again:
 		}
 	}
 
+	free(vnodes);
 	free(logs);
 	return EXIT_SUCCESS;
 error:
@@ -1305,6 +1311,113 @@ out:
 	return ret;
 }
 
+/* Number of data_vdi_id entries vdi_flatten() writes at most at once */
+#define FLATTEN_BATCH 256
+
+/* Point the entries [start, end) of data_vdi_id at the VDI itself */
+static int flatten_update_inode(struct sheepdog_inode *inode, int start,
+				int end)
+{
+	int ret;
+
+	if (start == end)
+		return SD_RES_SUCCESS;
+
+	ret = sd_write_object(vid_to_vdi_oid(inode->vdi_id), 0,
+			      inode->data_vdi_id + start,
+			      sizeof(uint32_t) * (end - start),
+			      SD_INODE_HEADER_SIZE + sizeof(uint32_t) * start,
+			      0, inode->nr_copies, 0);
+	if (ret != SD_RES_SUCCESS)
+		fprintf(stderr, "Failed to update the inode\n");
+	return ret;
+}
+
+/*
+ * Give a clone its own copy of every object it still reads from its base
+ * VDIs. The replicas copy the objects among themselves, and the inode is
+ * updated in runs of consecutive entries, so the entries a running guest
+ * fills in meanwhile are never overwritten. A guest write racing with the
+ * copy wins, as the copy never replaces an existing object.
+ */
+static int vdi_flatten(int argc, char **argv)
+{
+	char *vdiname = argv[optind++];
+	struct sheepdog_inode *inode;
+	uint32_t vid, base_vid, nr_objs, rate = vdi_cmd_data.rate;
+	int ret, idx, start = 0, nr_copied = 0;
+	struct timeval begin, now;
+	uint64_t elapsed, wanted;
+
+	ret = find_vdi_name(vdiname, 0, "", &vid, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to open VDI %s\n", vdiname);
+		return EXIT_FAILURE;
+	}
+
+	inode = xmalloc(sizeof(*inode));
+	ret = sd_read_object(vid_to_vdi_oid(vid), inode, SD_INODE_SIZE, 0);
+	if (ret != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to read an inode\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	gettimeofday(&begin, NULL);
+	nr_objs = DIV_ROUND_UP(inode->vdi_size, SD_DATA_OBJ_SIZE);
+	for (idx = 0; idx < nr_objs; idx++) {
+		base_vid = inode->data_vdi_id[idx];
+		if (!base_vid || base_vid == vid) {
+			ret = flatten_update_inode(inode, start, idx);
+			if (ret != SD_RES_SUCCESS)
+				goto fail;
+			start = idx + 1;
+			continue;
+		}
+
+		ret = sd_write_object(vid_to_data_oid(vid, idx),
+				      vid_to_data_oid(base_vid, idx), NULL, 0, 0,
+				      SD_FLAG_CMD_COW | SD_FLAG_CMD_EXCL,
+				      inode->nr_copies, 1);
+		if (ret != SD_RES_SUCCESS)
+			goto fail;
+		inode->data_vdi_id[idx] = vid;
+		nr_copied++;
+
+		if (idx + 1 - start == FLATTEN_BATCH) {
+			ret = flatten_update_inode(inode, start, idx + 1);
+			if (ret != SD_RES_SUCCESS)
+				goto fail;
+			start = idx + 1;
+		}
+
+		if (rate) {
+			gettimeofday(&now, NULL);
+			elapsed = (now.tv_sec - begin.tv_sec) * 1000000ULL +
+				now.tv_usec - begin.tv_usec;
+			wanted = (uint64_t)nr_copied * 1000000 / rate;
+			if (elapsed < wanted)
+				usleep(wanted - elapsed);
+		}
+	}
+
+	ret = flatten_update_inode(inode, start, idx);
+	if (ret != SD_RES_SUCCESS)
+		goto fail;
+
+	printf("%d objects copied\n", nr_copied);
+	ret = EXIT_SUCCESS;
+	goto out;
+fail:
+	/* keep what is already copied, running flatten again resumes */
+	flatten_update_inode(inode, start, idx);
+	fprintf(stderr, "Failed to flatten %s\n", vdiname);
+	ret = EXIT_FAILURE;
+out:
+	free(inode);
+	return ret;
+}
+
 static void *read_object_from(struct sd_vnode *vnode, uint64_t oid)
 {
 	struct sd_req hdr;
@@ -1395,7 +1508,8 @@ static void collie_oid_to_vnodes(struct sd_vnode *vnodes, int vnodes_nr,
 {
         int idx_buf[SD_MAX_COPIES], i, n;
 
-        obj_to_sheeps(vnodes, vnodes_nr, oid, nr_copies, idx_buf);
+        collie_obj_to_sheeps(sd_nodes, sd_nodes_nr, vnodes, vnodes_nr,
+			     oid, nr_copies, idx_buf);
 
         for (i = 0; i < nr_copies; i++) {
                 n = idx_buf[i];
@@ -1523,6 +1637,8 @@ static struct subcommand vdi_cmd[] = {
 	 SUBCMD_FLAG_NEED_NODELIST|SUBCMD_FLAG_NEED_THIRD_ARG, vdi_read},
 	{"write", "<vdiname> [<offset> [<len>]]", "aph", "write data to an image",
 	 SUBCMD_FLAG_NEED_NODELIST|SUBCMD_FLAG_NEED_THIRD_ARG, vdi_write},
+	{"flatten", "<vdiname>", "taph", "copy the data shared with base images into a clone",
+	 SUBCMD_FLAG_NEED_NODELIST|SUBCMD_FLAG_NEED_THIRD_ARG, vdi_flatten},
 	{NULL,},
 };
 
@@ -1555,6 +1671,13 @@ static int vdi_parser(int ch, char *opt)
 	case 'd':
 		vdi_cmd_data.delete = 1;
 		break;
+	case 't':
+		vdi_cmd_data.rate = strtoul(opt, &p, 10);
+		if (opt == p || *p) {
+			fprintf(stderr, "The rate must be an integer\n");
+			exit(EXIT_FAILURE);
+		}
+		break;
 	}
 
 	return 0;
@@ -19,7 +19,7 @@
 
 #include <stdint.h>
 
-#define SD_SHEEP_PROTO_VER 0x05
+#define SD_SHEEP_PROTO_VER 0x06
 
 #define SD_DEFAULT_REDUNDANCY 3
 #define SD_MAX_REDUNDANCY 8
@@ -27,6 +27,13 @@
 #define SD_MAX_COPIES 16
 #define SD_MAX_NODES 1024
 #define SD_DEFAULT_VNODES 64
+/*
+ * With -v auto, a node with SD_VNODE_REF_CAPACITY of store gets the default
+ * number of virtual nodes and others get proportionally more or fewer, but
+ * at least SD_MIN_AUTO_VNODES
+ */
+#define SD_VNODE_REF_CAPACITY (256ULL << 30)
+#define SD_MIN_AUTO_VNODES 16
 #define SD_MAX_VNODES 65536
 
 /*
@@ -52,12 +59,18 @@
 #define SD_OP_TRACE_CAT      0x96
 #define SD_OP_STAT_RECOVERY  0x97
 #define SD_OP_FLUSH_DEL_CACHE  0x98
+#define SD_OP_SET_RECOVERY   0x99
+#define SD_OP_SET_DELETION   0x9a
+#define SD_OP_READ_DELETIONS 0x9b
 #define SD_OP_GET_OBJ_LIST   0xA1
 #define SD_OP_GET_EPOCH      0xA2
 #define SD_OP_CREATE_AND_WRITE_PEER 0xa3
 #define SD_OP_READ_PEER      0xa4
 #define SD_OP_WRITE_PEER     0xa5
 #define SD_OP_REMOVE_PEER    0xa6
+#define SD_OP_GET_OBJ_DIGEST 0xa7
+#define SD_OP_REMOVE_OBJS    0xa8
+#define SD_OP_COPY_OBJ       0xa9
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
@@ -67,6 +80,9 @@
 #define SD_FLAG_CMD_EXCL     0x0200
 #define SD_FLAG_CMD_DEL      0x0400
 
+/* the requester of SD_OP_GET_OBJ_LIST follows next_cursor */
+#define SD_FLAG_CMD_PAGED    0x0800
+
 /* internal error return values, must be above 0x80 */
 #define SD_RES_OLD_NODE_VER  0x81 /* Remote node has an old epoch */
 #define SD_RES_NEW_NODE_VER  0x82 /* Remote node has a new epoch */
@@ -77,6 +93,15 @@
 
 #define SD_FLAG_NOHALT       0x0004 /* Serve the IO rquest even lack of nodes */
 
+/* The cluster flags carry the placement algorithm chosen at format time */
+#define SD_FLAG_PLACEMENT_SHIFT 12
+#define SD_FLAG_PLACEMENT_MASK  0xf000
+#define sd_placement(flags) \
+	(((flags) & SD_FLAG_PLACEMENT_MASK) >> SD_FLAG_PLACEMENT_SHIFT)
+
+#define SD_PLACEMENT_RING    0 /* consistent hashing ring of vnodes */
+#define SD_PLACEMENT_STRAW2  1 /* weighted rendezvous hashing */
+
 #define SD_STATUS_OK                0x00000001
 #define SD_STATUS_WAIT_FOR_FORMAT   0x00000002
 #define SD_STATUS_WAIT_FOR_JOIN     0x00000004
@@ -119,7 +144,8 @@ struct sd_list_req {
 	uint32_t        id;
 	uint32_t        data_length;
 	uint32_t        tgt_epoch;
-	uint32_t        pad[7];
+	uint64_t        cursor; /* smallest oid to return */
+	uint32_t        pad[4];
 };
 
 struct sd_list_rsp {
@@ -130,7 +156,9 @@ struct sd_list_rsp {
 	uint32_t        id;
 	uint32_t        data_length;
 	uint32_t        result;
-	uint32_t        pad[7];
+	uint32_t        more; /* set if the list didn't fit in the buffer */
+	uint64_t        next_cursor;
+	uint32_t        pad[4];
 };
 
 struct sd_node_req {
@@ -170,6 +198,51 @@ struct sd_node {
 	uint32_t	zone;
 };
 
+/* SD_OP_GET_OBJ_DIGEST returns the SHA1 of each block of this size */
+#define SD_RESYNC_BLOCK_SIZE (64 * 1024)
+
+/* payload of SD_OP_SET_RECOVERY */
+struct recovery_throttle {
+	uint32_t max_rate;	/* MB/s, 0 means unlimited */
+	uint32_t adaptive;	/* back off when foreground I/O is queueing */
+};
+
+/*
+ * Reply of SD_OP_STAT_RECOVERY, followed by nr_sources recovery_source_stat
+ * and nr_history recovery_history entries, newest first
+ */
+struct recovery_stat {
+	uint32_t epoch;		/* epoch being recovered, 0 if idle */
+	uint32_t preparing;	/* still collecting the object lists */
+	uint64_t nr_total;
+	uint64_t nr_done;
+	uint64_t nr_failed;
+	uint64_t bytes;		/* copied from other nodes */
+	uint64_t elapsed;	/* seconds */
+	uint64_t rate;		/* bytes per second over the last seconds */
+	uint64_t eta;		/* seconds, 0 if unknown */
+	uint32_t nr_sources;
+	uint32_t nr_history;
+};
+
+struct recovery_source_stat {
+	struct node_id nid;
+	uint16_t pad[3];
+	uint64_t nr_objs;
+	uint64_t bytes;
+};
+
+#define SD_RECOVERY_HISTORY 8
+
+struct recovery_history {
+	uint32_t epoch;
+	uint32_t completed;	/* 0 if superseded by a newer epoch */
+	uint64_t nr_done;
+	uint64_t nr_failed;
+	uint64_t bytes;
+	uint64_t elapsed;
+};
+
 struct epoch_log {
 	uint64_t ctime;
 	uint64_t time;
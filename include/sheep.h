@@ -110,6 +110,29 @@ static inline int get_vnode_pos(struct sd_vnode *entries,
 	}
 }
 
+/* Same as get_vnode_pos(), but searches a plain array of the ring ids */
+static inline int get_ring_pos(const uint64_t *ids, int nr_ids, uint64_t oid)
+{
+	uint64_t id = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+	int start, end, pos;
+
+	start = 0;
+	end = nr_ids - 1;
+
+	if (id > ids[end] || id < ids[start])
+		return end;
+
+	for (;;) {
+		pos = (end - start) / 2 + start;
+		if (ids[pos] < id) {
+			if (ids[pos + 1] >= id)
+				return pos;
+			start = pos;
+		} else
+			end = pos;
+	}
+}
+
 static inline int obj_to_sheep(struct sd_vnode *entries,
 			       int nr_entries, uint64_t oid, int idx)
 {
@@ -129,6 +152,77 @@ static inline void obj_to_sheeps(struct sd_vnode *entries,
 				(pos + 1) % nr_entries, idx);
 }
 
+static inline int64_t straw2_draw(const struct sd_node *n, uint64_t oid)
+{
+	uint64_t h = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+
+	h = fnv_64a_buf((void *)n->nid.addr, sizeof(n->nid.addr), h);
+	h = fnv_64a_buf((void *)&n->nid.port, sizeof(n->nid.port), h);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	/*
+	 * log2(u) / weight with u in (0, 1], in fixed point so that sheep and
+	 * collie on any host agree on the placement
+	 */
+	return ((int64_t)fixed_log2((h >> 33) + 1) - (31LL << 32)) /
+		n->nr_vnodes;
+}
+
+/*
+ * Straw2 placement: every node draws a straw whose length only depends on
+ * the object and the node itself, weighted by its number of vnodes, and
+ * the longest straws win. Adding or removing a node therefore only moves
+ * the objects that node wins or loses. A zone is as long as the longest
+ * straw of its nodes, which picks zones in proportion to their weight.
+ *
+ * Returns the number of node indices stored in idxs, which is less than
+ * nr_copies if there are not enough zones.
+ */
+static inline int obj_to_nodes_straw2(const struct sd_node *nodes, int nr_nodes,
+				      uint64_t oid, int nr_copies, int *idxs)
+{
+	int64_t draws[SD_MAX_COPIES], draw;
+	int i, j, nr = 0;
+
+	if (nr_copies <= 0)
+		return 0;
+
+	for (i = 0; i < nr_nodes; i++) {
+		if (!nodes[i].nr_vnodes)
+			continue;
+
+		draw = straw2_draw(nodes + i, oid);
+
+		for (j = 0; j < nr; j++) {
+			if (nodes[i].zone && nodes[i].zone == nodes[idxs[j]].zone)
+				break;
+		}
+		if (j < nr) {
+			/* keep the longest straw of the zone */
+			if (draw <= draws[j])
+				continue;
+			memmove(idxs + j, idxs + j + 1, sizeof(*idxs) * (nr - j - 1));
+			memmove(draws + j, draws + j + 1,
+				sizeof(*draws) * (nr - j - 1));
+			nr--;
+		} else if (nr == nr_copies && draw <= draws[nr - 1])
+			continue;
+
+		if (nr < nr_copies)
+			nr++;
+		for (j = nr - 1; j > 0 && draws[j - 1] < draw; j--) {
+			draws[j] = draws[j - 1];
+			idxs[j] = idxs[j - 1];
+		}
+		draws[j] = draw;
+		idxs[j] = i;
+	}
+
+	return nr;
+}
+
 static inline const char *sd_strerror(int err)
 {
 	int i;
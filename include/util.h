@@ -4,6 +4,7 @@
 #include <string.h>
 #include <limits.h>
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bitops.h"
@@ -62,6 +63,15 @@ static inline void *zalloc(size_t size)
 	return calloc(1, size);
 }
 
+/* Microseconds on a clock which doesn't jump when the system time is set */
+static inline uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 typedef void (*try_to_free_t)(size_t);
 extern try_to_free_t set_try_to_free_routine(try_to_free_t);
 
@@ -74,6 +84,7 @@ extern ssize_t xwrite(int fd, const void *buf, size_t len);
 extern ssize_t xpread(int fd, void *buf, size_t count, off_t offset);
 extern ssize_t xpwrite(int fd, const void *buf, size_t count, off_t offset);
 extern int rmdir_r(char *dir_path);
+extern uint64_t fixed_log2(uint32_t x);
 
 /* ring_buffer.c */
 struct rbuffer {
@@ -13,8 +13,11 @@
 
 #include <dirent.h>
 #include <pthread.h>
+#include <linux/fs.h>
 #include <linux/limits.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 #include "farm.h"
 #include "sheep_priv.h"
@@ -105,6 +108,64 @@ static int err_to_sderr(uint64_t oid, int err)
 	return ret;
 }
 
+/*
+ * Concurrent creators of the same object each get their own temporary
+ * file, so that the one that loses the link() race can't clobber the
+ * data of the winner.
+ */
+static void get_tmp_obj_path(char *path, size_t len, uint64_t oid)
+{
+	snprintf(path, len, "%s%016" PRIx64 ".tmp.%ld", obj_path, oid,
+		 syscall(SYS_gettid));
+}
+
+/*
+ * Create the object only if it doesn't exist. The data is written to a
+ * temporary file which is then linked into place, so nobody ever sees
+ * the object before it is complete and an object created meanwhile,
+ * e.g. by a copy-on-write of the guest, is kept as it is.
+ */
+static int farm_write_excl(uint64_t oid, struct siocb *iocb, int flags)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	int fd, ret = SD_RES_EIO;
+
+	snprintf(path, sizeof(path), "%s%016" PRIx64, obj_path, oid);
+	get_tmp_obj_path(tmp_path, sizeof(tmp_path), oid);
+	fd = open(tmp_path, flags | O_CREAT | O_TRUNC, def_fmode);
+	if (fd < 0) {
+		eprintf("failed to open %s: %m\n", tmp_path);
+		return SD_RES_EIO;
+	}
+
+	if (!(iocb->flags & SD_FLAG_CMD_COW)) {
+		ret = prealloc(fd, get_objsize(oid));
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		ret = SD_RES_EIO;
+	}
+	if (xpwrite(fd, iocb->buf, iocb->length, iocb->offset) != iocb->length) {
+		eprintf("failed to write %s: %m\n", tmp_path);
+		goto out;
+	}
+
+	if (link(tmp_path, path) < 0) {
+		/* someone else created it first, keep theirs */
+		if (errno == EEXIST)
+			ret = SD_RES_SUCCESS;
+		else
+			eprintf("failed to link %s to %s: %m\n", tmp_path, path);
+		goto out;
+	}
+
+	trunk_update_entry(oid);
+	ret = SD_RES_SUCCESS;
+out:
+	unlink(tmp_path);
+	close(fd);
+	return ret;
+}
+
 static int farm_write(uint64_t oid, struct siocb *iocb, int create)
 {
 	int flags = def_open_flags, fd, ret = SD_RES_SUCCESS;
@@ -118,7 +179,9 @@ static int farm_write(uint64_t oid, struct siocb *iocb, int create)
 	if (!is_data_obj(oid))
 		flags &= ~O_DIRECT;
 
-	if (create)
+	if (create && iocb->flags & SD_FLAG_CMD_EXCL)
+		return farm_write_excl(oid, iocb, flags);
+	else if (create)
 		flags |= O_CREAT | O_TRUNC;
 
 	sprintf(path, "%s%016"PRIx64, obj_path, oid);
@@ -442,6 +505,7 @@ static int farm_read(uint64_t oid, struct siocb *iocb)
 	ssize_t size;
 	int i;
 	void *buffer;
+	uint64_t off = 0;
 
 	if (iocb->epoch < epoch) {
 
@@ -461,10 +525,12 @@ static int farm_read(uint64_t oid, struct siocb *iocb)
 				if (buffer)
 					break;
 			}
+			/* a snapshot object is read as a whole */
+			off = iocb->offset;
 		}
 		if (!buffer)
 			return SD_RES_NO_OBJ;
-		memcpy(iocb->buf, buffer, iocb->length);
+		memcpy(iocb->buf, (char *)buffer + off, iocb->length);
 		free(buffer);
 
 		return SD_RES_SUCCESS;
@@ -499,6 +565,104 @@ out:
 	return ret;
 }
 
+/*
+ * Copy len bytes between two object files, sharing the extents when the
+ * filesystem can (FICLONE), copying inside the kernel when it can't, and
+ * falling back to read and write otherwise.
+ */
+static int copy_file_data(int src_fd, int dst_fd, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+	char *buf;
+
+#ifdef FICLONE
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+		return 0;
+#endif
+
+#ifdef __NR_copy_file_range
+	while (done < len) {
+		n = syscall(__NR_copy_file_range, src_fd, NULL, dst_fd, NULL,
+			    len - done, 0);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	if (done == len)
+		return 0;
+#endif
+
+	buf = valloc(len - done);
+	if (!buf)
+		return -1;
+	n = xpread(src_fd, buf, len - done, done);
+	if (n == len - done)
+		n = xpwrite(dst_fd, buf, len - done, done);
+	free(buf);
+
+	return n == len - done ? 0 : -1;
+}
+
+static int farm_copy(uint64_t src, uint64_t dst, struct siocb *iocb)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	int src_fd, dst_fd, ret = SD_RES_EIO;
+	struct stat s;
+
+	if (iocb->epoch < sys_epoch()) {
+		dprintf("%"PRIu32" sys %"PRIu32"\n", iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	snprintf(path, sizeof(path), "%s%016" PRIx64, obj_path, src);
+	src_fd = open(path, O_RDONLY);
+	if (src_fd < 0)
+		return err_to_sderr(src, errno);
+
+	if (fstat(src_fd, &s) < 0) {
+		eprintf("%m\n");
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%s%016" PRIx64, obj_path, dst);
+	get_tmp_obj_path(tmp_path, sizeof(tmp_path), dst);
+	dst_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, def_fmode);
+	if (dst_fd < 0) {
+		eprintf("failed to open %s: %m\n", tmp_path);
+		goto out;
+	}
+
+	if (copy_file_data(src_fd, dst_fd, s.st_size) < 0 ||
+	    fdatasync(dst_fd) < 0) {
+		eprintf("failed to copy %"PRIx64" to %"PRIx64": %m\n", src, dst);
+		unlink(tmp_path);
+		goto out_close;
+	}
+
+	/* SD_FLAG_CMD_EXCL leaves an existing dst alone */
+	if (iocb->flags & SD_FLAG_CMD_EXCL) {
+		if (link(tmp_path, path) < 0 && errno != EEXIST) {
+			eprintf("failed to link %s to %s: %m\n", tmp_path, path);
+			unlink(tmp_path);
+			goto out_close;
+		}
+		unlink(tmp_path);
+	} else if (rename(tmp_path, path) < 0) {
+		eprintf("failed to rename %s to %s: %m\n", tmp_path, path);
+		unlink(tmp_path);
+		goto out_close;
+	}
+
+	trunk_update_entry(dst);
+	ret = SD_RES_SUCCESS;
+out_close:
+	close(dst_fd);
+out:
+	close(src_fd);
+	return ret;
+}
+
 static int farm_atomic_put(uint64_t oid, struct siocb *iocb)
 {
 	char path[PATH_MAX], tmp_path[PATH_MAX];
@@ -763,7 +927,7 @@ static int farm_format(struct siocb *iocb)
 
 static int farm_purge_obj(void)
 {
-	if (cleanup_working_dir() < 0)
+	if (stash_stale_objects() < 0)
 		return SD_RES_EIO;
 	trunk_reset();
 
@@ -798,6 +962,7 @@ struct store_driver farm = {
 	.read = farm_read,
 	.link = farm_link,
 	.atomic_put = farm_atomic_put,
+	.copy = farm_copy,
 	.end_recover = farm_end_recover,
 	.snapshot = farm_snapshot,
 	.cleanup = farm_cleanup_sys_obj,
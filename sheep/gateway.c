@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include "sheep_priv.h"
 
@@ -20,7 +21,7 @@
  *
  * Return success if any read succeed.
  */
-int gateway_read_obj(struct request *req)
+static int forward_read_obj(struct request *req)
 {
 	int i, ret = SD_RES_SUCCESS;
 	unsigned wlen, rlen;
@@ -31,11 +32,8 @@ int gateway_read_obj(struct request *req)
 	uint64_t oid = req->rq.obj.oid;
 	int nr_copies, j;
 
-	if (sys->enable_write_cache && !req->local && !bypass_object_cache(req))
-		return object_cache_handle_request(req);
-
 	nr_copies = get_nr_copies(req->vnodes);
-	oid_to_vnodes(req->vnodes, oid, nr_copies, obj_vnodes);
+	nr_copies = oid_to_vnodes(req->vnodes, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (!vnode_is_local(v))
@@ -96,6 +94,60 @@ int gateway_read_obj(struct request *req)
 	return ret;
 }
 
+/*
+ * Serve reads of snapshot objects from the snapshot cache. Misses are
+ * widened to whole cache blocks so that the next reader hits.
+ */
+static int read_snapshot_obj(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid, offset = req->rq.obj.offset;
+	uint32_t len = req->rq.data_length;
+	uint64_t start, end;
+	struct request fill;
+	char *buf;
+	int ret;
+
+	if (!snapshot_cache_read(oid, req->data, len, offset)) {
+		req->rp.data_length = len;
+		return SD_RES_SUCCESS;
+	}
+
+	start = offset / SNAPSHOT_CACHE_BLOCK_SIZE * SNAPSHOT_CACHE_BLOCK_SIZE;
+	end = roundup(offset + len, SNAPSHOT_CACHE_BLOCK_SIZE);
+	buf = valloc(end - start);
+	if (!buf)
+		return forward_read_obj(req);
+
+	memset(&fill, 0, sizeof(fill));
+	fill.rq = req->rq;
+	fill.rq.obj.offset = start;
+	fill.rq.data_length = end - start;
+	fill.data = buf;
+	fill.vnodes = req->vnodes;
+
+	ret = forward_read_obj(&fill);
+	if (ret == SD_RES_SUCCESS) {
+		snapshot_cache_insert(oid, buf, end - start, start);
+		memcpy(req->data, buf + (offset - start), len);
+		req->rp = fill.rp;
+		req->rp.data_length = len;
+	}
+	free(buf);
+
+	return ret;
+}
+
+int gateway_read_obj(struct request *req)
+{
+	if (sys->enable_write_cache && !req->local && !bypass_object_cache(req))
+		return object_cache_handle_request(req);
+
+	if (snapshot_cache_enabled() && object_is_immutable(req->rq.obj.oid))
+		return read_snapshot_obj(req);
+
+	return forward_read_obj(req);
+}
+
 struct write_info_entry {
 	struct pollfd pfd;
 	struct node_id *nid;
@@ -227,6 +279,9 @@ static int do_gateway_write_obj(struct request *req, bool create)
 	uint64_t oid = req->rq.obj.oid;
 	int nr_copies;
 	struct write_info wi;
+	/* copy-on-write of a partial object, see peer_copy_obj() */
+	bool is_cow = req->rq.flags & SD_FLAG_CMD_COW &&
+		req->rq.data_length != SD_DATA_OBJ_SIZE;
 
 	dprintf("%"PRIx64"\n", oid);
 
@@ -235,7 +290,9 @@ static int do_gateway_write_obj(struct request *req, bool create)
 
 	write_info_init(&wi);
 	memcpy(&fwd_hdr, &req->rq, sizeof(fwd_hdr));
-	if (create)
+	if (create && is_cow)
+		fwd_hdr.opcode = SD_OP_COPY_OBJ;
+	else if (create)
 		fwd_hdr.opcode = SD_OP_CREATE_AND_WRITE_PEER;
 	else
 		fwd_hdr.opcode = SD_OP_WRITE_PEER;
@@ -244,7 +301,7 @@ static int do_gateway_write_obj(struct request *req, bool create)
 	wlen = fwd_hdr.data_length;
 
 	nr_copies = get_nr_copies(req->vnodes);
-	oid_to_vnodes(req->vnodes, oid, nr_copies, obj_vnodes);
+	nr_copies = oid_to_vnodes(req->vnodes, oid, nr_copies, obj_vnodes);
 
 	for (i = 0; i < nr_copies; i++) {
 		struct sockfd *sfd;
@@ -274,7 +331,9 @@ static int do_gateway_write_obj(struct request *req, bool create)
 	if (local != -1 && err_ret == SD_RES_SUCCESS) {
 		v = obj_vnodes[local];
 
-		if (create)
+		if (create && is_cow)
+			ret = peer_copy_obj(req);
+		else if (create)
 			ret = peer_create_and_write_obj(req);
 		else
 			ret = peer_write_obj(req);
@@ -295,8 +354,182 @@ static int do_gateway_write_obj(struct request *req, bool create)
 	return err_ret;
 }
 
+/*
+ * Inode update batching
+ *
+ * Every first write to a data object is followed by a write of its entry
+ * in data_vdi_id, each of them a replicated and journaled write of a few
+ * bytes. Updates of the same inode that arrive while one is in flight are
+ * queued, and the thread that finishes the write in flight sends all of
+ * them at once, one write per run of adjacent entries. Each inode has its
+ * own condition variable, so a finished write only wakes the requests
+ * waiting for that inode.
+ */
+#define INODE_BATCH_HASH_BITS	8
+#define INODE_BATCH_HASH_SIZE	(1 << INODE_BATCH_HASH_BITS)
+
+struct inode_update {
+	struct list_head list;
+	uint32_t start;		/* offset into the inode */
+	uint32_t len;
+	const char *data;
+	int result;
+	bool done;
+};
+
+struct inode_batch {
+	struct hlist_node hash;
+	uint64_t oid;
+	bool busy;
+	int nr_users; /* requests with an update in this batch */
+	pthread_cond_t cond;
+	struct list_head pending;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct hlist_head hash[INODE_BATCH_HASH_SIZE];
+} inode_batches = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool is_inode_entry_update(struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+
+	return !req->local && is_vdi_obj(hdr->obj.oid) &&
+		hdr->data_length && hdr->data_length % sizeof(uint32_t) == 0 &&
+		hdr->obj.offset >= SD_INODE_HEADER_SIZE &&
+		hdr->obj.offset % sizeof(uint32_t) == 0 &&
+		hdr->obj.offset + hdr->data_length <= SD_INODE_SIZE;
+}
+
+/* Caller should hold inode_batches.lock */
+static struct inode_batch *get_inode_batch(uint64_t oid)
+{
+	struct hlist_head *head;
+	struct inode_batch *b;
+	struct hlist_node *node;
+
+	head = inode_batches.hash + hash_64(oid, INODE_BATCH_HASH_BITS);
+	hlist_for_each_entry(b, node, head, hash) {
+		if (b->oid == oid)
+			return b;
+	}
+
+	b = xzalloc(sizeof(*b));
+	b->oid = oid;
+	pthread_cond_init(&b->cond, NULL);
+	INIT_LIST_HEAD(&b->pending);
+	hlist_add_head(&b->hash, head);
+	return b;
+}
+
+/*
+ * Write the updates as runs of adjacent or overlapping ranges. Within a
+ * run the updates are applied in arrival order, so the last one wins.
+ * Written updates are moved to the written list with their result set.
+ */
+static void write_inode_updates(uint64_t oid, struct list_head *updates,
+				struct list_head *written)
+{
+	struct inode_update *u, *first;
+	uint32_t start, end;
+	char *buf;
+	int ret;
+	bool grown;
+
+	while (!list_empty(updates)) {
+		first = list_first_entry(updates, struct inode_update, list);
+		start = first->start;
+		end = first->start + first->len;
+		do {
+			grown = false;
+			list_for_each_entry(u, updates, list) {
+				if (u->start > end || u->start + u->len < start)
+					continue;
+				if (u->start < start || u->start + u->len > end) {
+					start = min(start, u->start);
+					end = max(end, u->start + u->len);
+					grown = true;
+				}
+			}
+		} while (grown);
+
+		buf = xmalloc(end - start);
+		list_for_each_entry(u, updates, list) {
+			if (u->start >= start && u->start + u->len <= end)
+				memcpy(buf + u->start - start, u->data, u->len);
+		}
+
+		ret = write_object(oid, buf, end - start, start, 0, 0);
+		free(buf);
+
+		list_for_each_entry_safe(u, first, updates, list) {
+			if (u->start >= start && u->start + u->len <= end) {
+				u->result = ret;
+				list_move_tail(&u->list, written);
+			}
+		}
+	}
+}
+
+static int gateway_update_inode(struct request *req)
+{
+	struct inode_update u = {
+		.start = req->rq.obj.offset,
+		.len = req->rq.data_length,
+		.data = req->data,
+	};
+	struct inode_update *w, *n;
+	struct inode_batch *b;
+	LIST_HEAD(updates);
+	LIST_HEAD(written);
+
+	pthread_mutex_lock(&inode_batches.lock);
+	b = get_inode_batch(req->rq.obj.oid);
+	b->nr_users++;
+	list_add_tail(&u.list, &b->pending);
+	while (!u.done) {
+		if (b->busy) {
+			pthread_cond_wait(&b->cond, &inode_batches.lock);
+			continue;
+		}
+
+		b->busy = true;
+		list_splice_init(&b->pending, &updates);
+		pthread_mutex_unlock(&inode_batches.lock);
+
+		dprintf("%"PRIx64"\n", b->oid);
+		write_inode_updates(b->oid, &updates, &written);
+
+		/* waiters only look at their update with the lock held */
+		pthread_mutex_lock(&inode_batches.lock);
+		list_for_each_entry_safe(w, n, &written, list) {
+			list_del(&w->list);
+			w->done = true;
+		}
+		b->busy = false;
+		pthread_cond_broadcast(&b->cond);
+	}
+
+	if (--b->nr_users == 0) {
+		hlist_del(&b->hash);
+		pthread_cond_destroy(&b->cond);
+		free(b);
+	}
+	pthread_mutex_unlock(&inode_batches.lock);
+
+	return u.result;
+}
+
 int gateway_write_obj(struct request *req)
 {
+	/* requests for the object cache are merged there */
+	if (is_inode_entry_update(req) &&
+	    !(sys->enable_write_cache && req->rq.flags & SD_FLAG_CMD_CACHE))
+		return gateway_update_inode(req);
+
 	return do_gateway_write_obj(req, false);
 }
 
@@ -327,7 +560,7 @@ int gateway_remove_obj(struct request *req)
 	wlen = fwd_hdr.data_length;
 
 	nr_copies = get_nr_copies(req->vnodes);
-	oid_to_vnodes(req->vnodes, oid, nr_copies, obj_vnodes);
+	nr_copies = oid_to_vnodes(req->vnodes, oid, nr_copies, obj_vnodes);
 
 	for (i = 0; i < nr_copies; i++) {
 		struct sockfd *sfd;
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <sys/epoll.h>
@@ -151,40 +152,61 @@ void put_vnode_info(struct vnode_info *vnode_info)
 	if (vnode_info) {
 		assert(uatomic_read(&vnode_info->refcnt) > 0);
 
-		if (uatomic_sub_return(&vnode_info->refcnt, 1) == 0)
+		if (uatomic_sub_return(&vnode_info->refcnt, 1) == 0) {
+			free(vnode_info->placement_table);
 			free(vnode_info);
+		}
 	}
 }
 
 struct sd_vnode *oid_to_vnode(struct vnode_info *vnode_info, uint64_t oid,
 		int copy_idx)
 {
-	int idx = obj_to_sheep(vnode_info->vnodes, vnode_info->nr_vnodes,
-			oid, copy_idx);
+	int idx_buf[SD_MAX_COPIES], nr;
+
+	nr = vnode_info->placement->oid_to_vnodes(vnode_info, oid,
+						  copy_idx + 1, idx_buf);
+	if (nr <= copy_idx)
+		return NULL;
 
-	return &vnode_info->vnodes[idx];
+	return &vnode_info->vnodes[idx_buf[copy_idx]];
 }
 
-void oid_to_vnodes(struct vnode_info *vnode_info, uint64_t oid, int nr_copies,
+/*
+ * Returns the number of vnodes stored, which is less than nr_copies if the
+ * placement can't find that many zones for the object.
+ */
+int oid_to_vnodes(struct vnode_info *vnode_info, uint64_t oid, int nr_copies,
 		struct sd_vnode **vnodes)
 {
-	int idx_buf[SD_MAX_COPIES], i, n;
+	int idx_buf[SD_MAX_COPIES], i, n, nr;
 
-	obj_to_sheeps(vnode_info->vnodes, vnode_info->nr_vnodes,
-			oid, nr_copies, idx_buf);
+	nr = vnode_info->placement->oid_to_vnodes(vnode_info, oid, nr_copies,
+						  idx_buf);
 
-	for (i = 0; i < nr_copies; i++) {
+	for (i = 0; i < nr; i++) {
 		n = idx_buf[i];
 		vnodes[i] = &vnode_info->vnodes[n];
 	}
+
+	return nr;
 }
 
 static struct vnode_info *alloc_vnode_info(struct sd_node *nodes,
 					   size_t nr_nodes)
 {
 	struct vnode_info *vnode_info;
-
-	vnode_info = xzalloc(sizeof(*vnode_info));
+	int i, nr_vnodes = nodes_to_vnodes(nodes, nr_nodes, NULL);
+
+	vnode_info = xmalloc(sizeof(*vnode_info) +
+			     nr_vnodes * sizeof(uint64_t) +
+			     nr_vnodes * sizeof(struct sd_vnode) +
+			     nr_nodes * sizeof(struct sd_node));
+	memset(vnode_info, 0, sizeof(*vnode_info));
+	vnode_info->vnode_ids = (uint64_t *)(vnode_info + 1);
+	vnode_info->vnodes = (struct sd_vnode *)(vnode_info->vnode_ids +
+						 nr_vnodes);
+	vnode_info->nodes = (struct sd_node *)(vnode_info->vnodes + nr_vnodes);
 
 	vnode_info->nr_nodes = nr_nodes;
 	memcpy(vnode_info->nodes, nodes, sizeof(*nodes) * nr_nodes);
@@ -192,16 +214,123 @@ static struct vnode_info *alloc_vnode_info(struct sd_node *nodes,
 
 	vnode_info->nr_vnodes = nodes_to_vnodes(nodes, nr_nodes,
 						vnode_info->vnodes);
+	for (i = 0; i < nr_vnodes; i++)
+		vnode_info->vnode_ids[i] = vnode_info->vnodes[i].id;
 	vnode_info->nr_zones = get_zones_nr_from(nodes, nr_nodes);
+
+	vnode_info->placement = find_placement_driver(sd_placement(sys->flags));
+	if (!vnode_info->placement)
+		panic("placement %d not supported\n", sd_placement(sys->flags));
+	vnode_info->placement->init(vnode_info);
+
 	uatomic_set(&vnode_info->refcnt, 1);
 	return vnode_info;
 }
 
+/*
+ * Rebuild the current vnode info after the placement algorithm changed,
+ * which only happens when the cluster is formatted.
+ */
+void refresh_vnode_info(void)
+{
+	struct vnode_info *old = current_vnode_info;
+
+	if (!old || old->placement ==
+	    find_placement_driver(sd_placement(sys->flags)))
+		return;
+
+	current_vnode_info = alloc_vnode_info(old->nodes, old->nr_nodes);
+	put_vnode_info(old);
+}
+
+/* Number of past epochs whose vnode info is kept around */
+#define VNODE_CACHE_SIZE 8
+
+/*
+ * Recovery walks back through old epochs for every object it can't find,
+ * so keep the vnode info of recently used epochs instead of rebuilding it
+ * from the epoch log each time. Each slot holds a reference.
+ */
+static struct {
+	pthread_mutex_t lock;
+	uint64_t clock;
+	struct {
+		uint32_t epoch;
+		uint64_t last_used;
+		struct vnode_info *vnode_info;
+	} slot[VNODE_CACHE_SIZE];
+} vnode_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Caller should hold vnode_cache.lock */
+static struct vnode_info *vnode_cache_lookup(uint32_t epoch)
+{
+	int i;
+
+	for (i = 0; i < VNODE_CACHE_SIZE; i++) {
+		if (!vnode_cache.slot[i].vnode_info ||
+		    vnode_cache.slot[i].epoch != epoch)
+			continue;
+		vnode_cache.slot[i].last_used = ++vnode_cache.clock;
+		return grab_vnode_info(vnode_cache.slot[i].vnode_info);
+	}
+	return NULL;
+}
+
+/* Caller should hold vnode_cache.lock */
+static void vnode_cache_insert(uint32_t epoch, struct vnode_info *vnode_info)
+{
+	int i, victim = 0;
+
+	for (i = 0; i < VNODE_CACHE_SIZE; i++) {
+		if (!vnode_cache.slot[i].vnode_info) {
+			victim = i;
+			break;
+		}
+		if (vnode_cache.slot[i].last_used <
+		    vnode_cache.slot[victim].last_used)
+			victim = i;
+	}
+
+	put_vnode_info(vnode_cache.slot[victim].vnode_info);
+	vnode_cache.slot[victim].epoch = epoch;
+	vnode_cache.slot[victim].last_used = ++vnode_cache.clock;
+	vnode_cache.slot[victim].vnode_info = grab_vnode_info(vnode_info);
+}
+
+/* Forget the vnode info of an epoch whose log is rewritten or removed */
+void invalidate_vnode_info_epoch(uint32_t epoch)
+{
+	int i;
+
+	pthread_mutex_lock(&vnode_cache.lock);
+	for (i = 0; i < VNODE_CACHE_SIZE; i++) {
+		if (!vnode_cache.slot[i].vnode_info ||
+		    vnode_cache.slot[i].epoch != epoch)
+			continue;
+		put_vnode_info(vnode_cache.slot[i].vnode_info);
+		vnode_cache.slot[i].vnode_info = NULL;
+	}
+	pthread_mutex_unlock(&vnode_cache.lock);
+}
+
+/*
+ * Get a reference to the vnode information of the given epoch, which can be
+ * called from any thread. Release it with put_vnode_info().
+ */
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch)
 {
 	struct sd_node nodes[SD_MAX_NODES];
+	struct vnode_info *vnode_info, *cached;
 	int nr_nodes;
 
+	pthread_mutex_lock(&vnode_cache.lock);
+	vnode_info = vnode_cache_lookup(epoch);
+	pthread_mutex_unlock(&vnode_cache.lock);
+	if (vnode_info)
+		return vnode_info;
+
 	nr_nodes = epoch_log_read(epoch, nodes, sizeof(nodes));
 	if (nr_nodes < 0) {
 		nr_nodes = epoch_log_read_remote(epoch, nodes, sizeof(nodes));
@@ -209,7 +338,19 @@ struct vnode_info *get_vnode_info_epoch(uint32_t epoch)
 			return NULL;
 	}
 
-	return alloc_vnode_info(nodes, nr_nodes);
+	vnode_info = alloc_vnode_info(nodes, nr_nodes);
+
+	pthread_mutex_lock(&vnode_cache.lock);
+	/* somebody else may have built it in the meantime */
+	cached = vnode_cache_lookup(epoch);
+	if (cached) {
+		put_vnode_info(vnode_info);
+		vnode_info = cached;
+	} else
+		vnode_cache_insert(epoch, vnode_info);
+	pthread_mutex_unlock(&vnode_cache.lock);
+
+	return vnode_info;
 }
 
 int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
@@ -233,6 +374,8 @@ int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
 	}
 
 	node_rsp->master_idx = -1;
+	/* let clients locate objects with the placement of the cluster */
+	node_rsp->flags = sys->flags & SD_FLAG_PLACEMENT_MASK;
 	return SD_RES_SUCCESS;
 }
 
@@ -639,48 +782,73 @@ static int get_cluster_status(struct sd_node *joined, struct sd_node *entries,
 	}
 }
 
-static int get_vdi_bitmap_from(struct sd_node *node)
+static int read_bitmap_from(struct sd_node *node, int opcode,
+			    unsigned long *bitmap, const char *what)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	static DECLARE_BITMAP(tmp_vdi_inuse, SD_NR_VDIS);
-	int fd, i, ret = SD_RES_SUCCESS;
+	int fd, ret;
 	unsigned int rlen, wlen;
 	char host[128];
 
-	if (is_myself(node->nid.addr, node->nid.port))
-		goto out;
-
 	addr_to_str(host, sizeof(host), node->nid.addr, 0);
 
 	fd = connect_to(host, node->nid.port);
 	if (fd < 0) {
-		vprintf(SDOG_ERR, "unable to get the VDI bitmap from %s: %m\n", host);
-		ret = -SD_RES_EIO;
-		goto out;
+		vprintf(SDOG_ERR, "unable to get the %s from %s: %m\n", what,
+			host);
+		return -SD_RES_EIO;
 	}
 
 	vprintf(SDOG_ERR, "%s:%d\n", host, node->nid.port);
 
-	sd_init_req(&hdr, SD_OP_READ_VDIS);
+	sd_init_req(&hdr, opcode);
 	hdr.epoch = sys->epoch;
-	hdr.data_length = sizeof(tmp_vdi_inuse);
+	hdr.data_length = sizeof(sys->vdi_inuse);
 	rlen = hdr.data_length;
 	wlen = 0;
 
-	ret = exec_req(fd, &hdr, (char *)tmp_vdi_inuse,
-			&wlen, &rlen);
+	ret = exec_req(fd, &hdr, (char *)bitmap, &wlen, &rlen);
 
 	close(fd);
 
 	if (ret || rsp->result != SD_RES_SUCCESS) {
-		vprintf(SDOG_ERR, "unable to get the VDI bitmap (%d, %d)\n", ret,
-				rsp->result);
-		goto out;
+		vprintf(SDOG_ERR, "unable to get the %s (%d, %d)\n", what,
+			ret, rsp->result);
+		return ret ? ret : rsp->result;
 	}
 
+	return SD_RES_SUCCESS;
+}
+
+static int get_vdi_bitmap_from(struct sd_node *node)
+{
+	static DECLARE_BITMAP(tmp_vdi_inuse, SD_NR_VDIS);
+	static DECLARE_BITMAP(tmp_deletions, SD_NR_VDIS);
+	unsigned long vid;
+	int i, ret = SD_RES_SUCCESS;
+
+	if (is_myself(node->nid.addr, node->nid.port))
+		goto out;
+
+	ret = read_bitmap_from(node, SD_OP_READ_VDIS, tmp_vdi_inuse,
+			       "VDI bitmap");
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
 	for (i = 0; i < ARRAY_SIZE(sys->vdi_inuse); i++)
 		sys->vdi_inuse[i] |= tmp_vdi_inuse[i];
+
+	/* so that we can take over deletions started before we joined */
+	ret = read_bitmap_from(node, SD_OP_READ_DELETIONS, tmp_deletions,
+			       "deletion list");
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	vid = find_next_bit(tmp_deletions, SD_NR_VDIS, 0);
+	for (; vid < SD_NR_VDIS;
+	     vid = find_next_bit(tmp_deletions, SD_NR_VDIS, vid + 1))
+		add_deletion_mark(vid);
 out:
 	return ret;
 }
@@ -713,6 +881,8 @@ static void get_vdi_bitmap_done(struct work *work)
 		container_of(work, struct vdi_bitmap_work, work);
 
 	free(w);
+	warmup_vdi_index();
+	resume_deletion();
 }
 
 int log_current_epoch(void)
@@ -742,6 +912,7 @@ static void finish_join(struct join_message *msg, struct sd_node *joined,
 {
 	sys->join_finished = 1;
 	sys->nr_copies = msg->nr_copies;
+	sys->flags = msg->cluster_flags;
 	sys->epoch = msg->epoch;
 
 	if (msg->cluster_status != SD_STATUS_OK)
@@ -1070,6 +1241,8 @@ void sd_leave_handler(struct sd_node *left, struct sd_node *members,
 		uatomic_inc(&sys->epoch);
 		log_current_epoch();
 		start_recovery(current_vnode_info, old_vnode_info);
+		/* take over the deletions the node left unfinished */
+		resume_deletion();
 	}
 	put_vnode_info(old_vnode_info);
 
@@ -20,7 +20,9 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <sys/syscall.h>
 
 #include "sheep_priv.h"
 #include "util.h"
@@ -38,17 +40,68 @@
 #define CACHE_VDI_BIT         (UINT32_C(1) << CACHE_VDI_SHIFT)
 #define CACHE_BLOCK_SIZE      ((UINT64_C(1) << 10) * 64) /* 64 KB */
 
+/*
+ * Dirty log
+ *
+ * Each cached VDI keeps an append-only log of dirty bitmaps in
+ * cache_dir/%06x/.dirty_log, so that the dirty index survives a crash or
+ * restart and is replayed by object_cache_init(). A record with an empty
+ * bmap drops the object from the index. Records are synced before the
+ * data they cover is written to the cache file. A push that leaves nothing
+ * dirty truncates the log, and the log is rewritten with the entries still
+ * dirty once most of its records are stale.
+ */
+#define DIRTY_LOG_NAME        ".dirty_log"
+#define DIRTY_LOG_COMPACT_MIN 4096 /* records */
+
+struct dirty_log_entry {
+	uint32_t idx;
+	uint32_t create;
+	uint64_t bmap;
+};
+
+/*
+ * Warm-up
+ *
+ * When the cache of a VDI is flushed and dropped (typically when the VM
+ * closes it), the set of cached objects is saved in cache_dir/.warmup/%06x.
+ * The next time the VDI is accessed through the cache, those objects are
+ * pulled back in the background, at most WARMUP_RATE bytes per second.
+ */
+#define WARMUP_DIR            ".warmup"
+#define WARMUP_RATE           (32 * 1024 * 1024)
+
+struct warmup_work {
+	uint32_t vid;
+	struct work work;
+};
+
+/*
+ * Dirty tracking
+ *
+ * The entries of a VDI are spread over DIRTY_STRIPES rb-trees, each with its
+ * own lock, so writers to different objects of one VDI don't serialize. An
+ * entry that turns dirty is pushed onto a lock-free stack, which the flusher
+ * takes over in one atomic exchange.
+ */
+#define DIRTY_STRIPES         16
+
+struct dirty_stripe {
+	pthread_mutex_t lock;
+	struct rb_root tree;
+};
+
 struct object_cache {
 	uint32_t vid;
 	struct hlist_node hash;
 
-	struct list_head dirty_lists[2];
-	struct list_head *active_dirty_list;
+	struct dirty_stripe stripes[DIRTY_STRIPES];
+	struct object_cache_entry *dirty_stack;
 
-	struct rb_root dirty_trees[2];
-	struct rb_root *active_dirty_tree;
-
-	pthread_mutex_t lock;
+	int log_fd;
+	int log_broken;
+	uint32_t log_records;
+	pthread_rwlock_t log_lock; /* held exclusively while compacting */
 };
 
 struct object_cache_entry {
@@ -56,26 +109,70 @@ struct object_cache_entry {
 	uint64_t bmap; /* each bit represents one dirty
 			* block which should be flushed */
 	struct rb_node rb;
-	struct list_head list;
+	struct object_cache_entry *next_dirty;
+	int queued; /* on the dirty stack */
 	int create;
 };
 
-static char cache_dir[PATH_MAX];
-static int def_open_flags = O_RDWR;
+/*
+ * Memory tier
+ *
+ * An optional pool of CACHE_BLOCK_SIZE buffers in front of the cache
+ * files, sized by the -m option. It only keeps clean copies of hot blocks:
+ * writes go through to the cache file and invalidate the memory copy, so
+ * the dirty log never has to cover data that lives in memory only.
+ */
+#define MEM_HASH_BITS         10
+#define MEM_HASH_SIZE         (1 << MEM_HASH_BITS)
 
-#define HASH_BITS	5
-#define HASH_SIZE	(1 << HASH_BITS)
+struct mem_block {
+	uint32_t vid;
+	uint32_t idx;
+	uint32_t blk;
+	char *data;
+	struct hlist_node hash;
+	struct list_head list; /* on the lru or the free list */
+};
+
+struct mem_bucket {
+	struct hlist_head head;
+	uint64_t gen; /* bumped on invalidation to cancel racing fills */
+};
 
-static pthread_mutex_t hashtable_lock[HASH_SIZE] = {
-	[0 ... HASH_SIZE - 1] = PTHREAD_MUTEX_INITIALIZER
+static struct {
+	pthread_mutex_t lock;
+	struct mem_bucket buckets[MEM_HASH_SIZE];
+	struct list_head lru;
+	struct list_head free;
+	struct mem_block *blocks;
+	size_t nr_blocks;
+} mem_tier = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.lru = LIST_HEAD_INIT(mem_tier.lru),
+	.free = LIST_HEAD_INIT(mem_tier.free),
 };
 
-static struct hlist_head cache_hashtable[HASH_SIZE];
+static char cache_dir[PATH_MAX];
+static int def_open_flags = O_RDWR;
 
-static inline int hash(uint64_t vid)
-{
-	return hash_64(vid, HASH_BITS);
-}
+/*
+ * The VDI index starts with 1 << INIT_HASH_BITS buckets and doubles when
+ * it holds more caches than buckets. Lookups only take the lock shared.
+ */
+#define INIT_HASH_BITS	5
+
+static struct hlist_head init_buckets[1 << INIT_HASH_BITS];
+
+static struct {
+	pthread_rwlock_t lock;
+	struct hlist_head *buckets;
+	int bits;
+	int nr;
+} cache_index = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+	.buckets = init_buckets,
+	.bits = INIT_HASH_BITS,
+};
 
 static inline uint32_t object_cache_oid_to_idx(uint64_t oid)
 {
@@ -170,97 +267,277 @@ err:
 	return ret;
 }
 
-static struct object_cache *find_object_cache(uint32_t vid, int create)
+static void get_dirty_log_path(struct strbuf *buf, uint32_t vid)
 {
-	int h = hash(vid);
-	struct hlist_head *head = cache_hashtable + h;
-	struct object_cache *cache = NULL;
-	struct hlist_node *node;
+	strbuf_addf(buf, "%s/%06"PRIx32"/"DIRTY_LOG_NAME, cache_dir, vid);
+}
 
-	pthread_mutex_lock(&hashtable_lock[h]);
-	if (hlist_empty(head))
-		goto not_found;
+static void get_warmup_path(struct strbuf *buf, uint32_t vid)
+{
+	strbuf_addf(buf, "%s/"WARMUP_DIR"/%06"PRIx32, cache_dir, vid);
+}
+
+static int open_dirty_log(uint32_t vid)
+{
+	struct strbuf buf = STRBUF_INIT;
+	int fd;
+
+	get_dirty_log_path(&buf, vid);
+	fd = open(buf.buf, O_WRONLY | O_CREAT | O_APPEND | O_DSYNC, def_fmode);
+	if (fd < 0)
+		eprintf("%s, %m\n", buf.buf);
+	strbuf_release(&buf);
+	return fd;
+}
+
+/* Caller should hold the cache_index.lock */
+static struct object_cache *lookup_object_cache(uint32_t vid)
+{
+	struct hlist_head *head;
+	struct object_cache *cache;
+	struct hlist_node *node;
 
+	head = cache_index.buckets + hash_64(vid, cache_index.bits);
 	hlist_for_each_entry(cache, node, head, hash) {
 		if (cache->vid == vid)
-			goto out;
+			return cache;
 	}
-not_found:
-	if (create) {
-		cache = xzalloc(sizeof(*cache));
-		cache->vid = vid;
-		create_dir_for(vid);
+	return NULL;
+}
 
-		cache->dirty_trees[0] = RB_ROOT;
-		cache->dirty_trees[1] = RB_ROOT;
-		cache->active_dirty_tree = &cache->dirty_trees[0];
+/* Caller should hold the cache_index.lock exclusively */
+static void grow_cache_index(void)
+{
+	int i, bits = cache_index.bits + 1;
+	struct hlist_head *buckets;
+	struct object_cache *cache;
+	struct hlist_node *node, *n;
+
+	buckets = xzalloc(sizeof(*buckets) << bits);
+	for (i = 0; i < (1 << cache_index.bits); i++) {
+		hlist_for_each_entry_safe(cache, node, n,
+					  cache_index.buckets + i, hash) {
+			hlist_del(&cache->hash);
+			hlist_add_head(&cache->hash,
+				       buckets + hash_64(cache->vid, bits));
+		}
+	}
 
-		INIT_LIST_HEAD(&cache->dirty_lists[0]);
-		INIT_LIST_HEAD(&cache->dirty_lists[1]);
-		cache->active_dirty_list = &cache->dirty_lists[0];
+	if (cache_index.buckets != init_buckets)
+		free(cache_index.buckets);
+	cache_index.buckets = buckets;
+	cache_index.bits = bits;
+	dprintf("%d buckets\n", 1 << bits);
+}
+
+static struct object_cache *alloc_object_cache(uint32_t vid)
+{
+	struct object_cache *cache;
+	int i;
+
+	cache = xzalloc(sizeof(*cache));
+	cache->vid = vid;
+	create_dir_for(vid);
+	cache->log_fd = open_dirty_log(vid);
+	pthread_rwlock_init(&cache->log_lock, NULL);
+
+	for (i = 0; i < DIRTY_STRIPES; i++) {
+		pthread_mutex_init(&cache->stripes[i].lock, NULL);
+		cache->stripes[i].tree = RB_ROOT;
+	}
+
+	return cache;
+}
+
+static struct object_cache *find_object_cache(uint32_t vid, int create)
+{
+	struct object_cache *cache;
+
+	pthread_rwlock_rdlock(&cache_index.lock);
+	cache = lookup_object_cache(vid);
+	pthread_rwlock_unlock(&cache_index.lock);
+	if (cache || !create)
+		return cache;
+
+	pthread_rwlock_wrlock(&cache_index.lock);
+	cache = lookup_object_cache(vid);
+	if (!cache) {
+		cache = alloc_object_cache(vid);
+		hlist_add_head(&cache->hash, cache_index.buckets +
+			       hash_64(vid, cache_index.bits));
+		if (++cache_index.nr > (1 << cache_index.bits))
+			grow_cache_index();
+	}
+	pthread_rwlock_unlock(&cache_index.lock);
 
-		pthread_mutex_init(&cache->lock, NULL);
-		hlist_add_head(&cache->hash, head);
-	} else
-		cache = NULL;
-out:
-	pthread_mutex_unlock(&hashtable_lock[h]);
 	return cache;
 }
 
-static inline void
-del_from_dirty_tree_and_list(struct object_cache_entry *entry,
-			     struct rb_root *dirty_tree)
+static inline struct dirty_stripe *stripe_of(struct object_cache *oc,
+					     uint32_t idx)
 {
-	rb_erase(&entry->rb, dirty_tree);
-	list_del(&entry->list);
+	return oc->stripes + idx % DIRTY_STRIPES;
 }
 
-static void switch_dirty_tree_and_list(struct object_cache *oc,
-				       struct rb_root **inactive_dirty_tree,
-				       struct list_head **inactive_dirty_list)
+/* Caller should hold the stripe lock of the entry */
+static void push_dirty_entry(struct object_cache *oc,
+			     struct object_cache_entry *entry)
 {
-	pthread_mutex_lock(&oc->lock);
+	struct object_cache_entry *head;
 
-	*inactive_dirty_list = oc->active_dirty_list;
-	*inactive_dirty_tree = oc->active_dirty_tree;
+	entry->queued = 1;
+	do {
+		head = uatomic_read(&oc->dirty_stack);
+		entry->next_dirty = head;
+	} while (uatomic_cmpxchg(&oc->dirty_stack, head, entry) != head);
+}
 
-	if (oc->active_dirty_tree == &oc->dirty_trees[0]) {
-		oc->active_dirty_list = &oc->dirty_lists[1];
-		oc->active_dirty_tree = &oc->dirty_trees[1];
-	} else {
-		oc->active_dirty_list = &oc->dirty_lists[0];
-		oc->active_dirty_tree = &oc->dirty_trees[0];
+/* Caller should hold the log_lock */
+static void dirty_log_write(struct object_cache *oc, uint32_t idx,
+			    uint64_t bmap, int create)
+{
+	struct dirty_log_entry e = {
+		.idx = idx,
+		.create = create,
+		.bmap = bmap,
+	};
+
+	if (oc->log_fd < 0 || oc->log_broken)
+		return;
+
+	if (xwrite(oc->log_fd, &e, sizeof(e)) != sizeof(e)) {
+		/* A torn record would misalign the log until compaction */
+		eprintf("failed to log %"PRIx32", %m\n", idx);
+		oc->log_broken = 1;
+		return;
 	}
+	uatomic_inc(&oc->log_records);
+}
 
-	pthread_mutex_unlock(&oc->lock);
+static void dirty_log_append(struct object_cache *oc, uint32_t idx,
+			     uint64_t bmap, int create)
+{
+	pthread_rwlock_rdlock(&oc->log_lock);
+	dirty_log_write(oc, idx, bmap, create);
+	pthread_rwlock_unlock(&oc->log_lock);
 }
 
-/* Caller should hold the oc->lock */
-static inline void
-add_to_dirty_tree_and_list(struct object_cache *oc,
-			   struct object_cache_entry *entry)
+/* Caller should hold the log_lock exclusively */
+static int count_dirty_entries(struct object_cache *oc)
 {
-	if (!dirty_tree_insert(oc->active_dirty_tree, entry))
-		list_add(&entry->list, oc->active_dirty_list);
-	else
-		free(entry);
+	struct object_cache_entry *entry;
+	struct dirty_stripe *stripe;
+	struct rb_node *n;
+	int i, nr = 0;
+
+	for (i = 0; i < DIRTY_STRIPES; i++) {
+		stripe = oc->stripes + i;
+		pthread_mutex_lock(&stripe->lock);
+		for (n = rb_first(&stripe->tree); n; n = rb_next(n)) {
+			entry = rb_entry(n, struct object_cache_entry, rb);
+			if (entry->bmap)
+				nr++;
+		}
+		pthread_mutex_unlock(&stripe->lock);
+	}
+
+	return nr;
 }
 
-static void merge_dirty_tree_and_list(struct object_cache *oc,
-				      struct rb_root *inactive_dirty_tree,
-				      struct list_head *inactive_dirty_list)
+/* Rewrite the dirty log with the entries which are still dirty */
+static int dirty_log_rewrite(struct object_cache *oc, int nr)
 {
-	struct object_cache_entry *entry, *t;
+	struct strbuf path = STRBUF_INIT, tmp = STRBUF_INIT;
+	struct object_cache_entry *entry;
+	struct dirty_log_entry *log;
+	struct dirty_stripe *stripe;
+	struct rb_node *n;
+	size_t len;
+	int i, fd, ret = -1, count = 0;
+
+	get_dirty_log_path(&path, oc->vid);
+	strbuf_addf(&tmp, "%s.tmp", path.buf);
+
+	log = xmalloc(nr * sizeof(*log));
+	for (i = 0; i < DIRTY_STRIPES; i++) {
+		stripe = oc->stripes + i;
+		pthread_mutex_lock(&stripe->lock);
+		for (n = rb_first(&stripe->tree); n && count < nr;
+		     n = rb_next(n)) {
+			entry = rb_entry(n, struct object_cache_entry, rb);
+			if (!entry->bmap)
+				continue;
+			log[count].idx = entry->idx;
+			log[count].create = entry->create;
+			log[count].bmap = entry->bmap;
+			count++;
+		}
+		pthread_mutex_unlock(&stripe->lock);
+	}
+	len = count * sizeof(*log);
 
-	pthread_mutex_lock(&oc->lock);
+	fd = open(tmp.buf, O_WRONLY | O_CREAT | O_TRUNC, def_fmode);
+	if (fd < 0) {
+		eprintf("%s, %m\n", tmp.buf);
+		goto out;
+	}
+	if (xwrite(fd, log, len) != len || fdatasync(fd) < 0) {
+		eprintf("%s, %m\n", tmp.buf);
+		close(fd);
+		unlink(tmp.buf);
+		goto out;
+	}
+	close(fd);
 
-	list_for_each_entry_safe(entry, t, inactive_dirty_list, list) {
-		del_from_dirty_tree_and_list(entry, inactive_dirty_tree);
-		add_to_dirty_tree_and_list(oc, entry);
+	if (rename(tmp.buf, path.buf) < 0) {
+		eprintf("%s, %m\n", path.buf);
+		unlink(tmp.buf);
+		goto out;
 	}
 
-	pthread_mutex_unlock(&oc->lock);
+	if (oc->log_fd >= 0)
+		close(oc->log_fd);
+	oc->log_fd = open_dirty_log(oc->vid);
+	oc->log_records = count;
+	ret = 0;
+out:
+	free(log);
+	strbuf_release(&tmp);
+	strbuf_release(&path);
+	return ret;
+}
+
+/*
+ * Drop the stale records of the dirty log. The log is truncated when
+ * nothing is dirty, and otherwise only rewritten when forced, broken or
+ * mostly stale. Returns the number of dirty entries.
+ */
+static int dirty_log_compact(struct object_cache *oc, int force)
+{
+	int nr;
+
+	pthread_rwlock_wrlock(&oc->log_lock);
+	nr = count_dirty_entries(oc);
+	if (!nr && oc->log_fd >= 0) {
+		if (ftruncate(oc->log_fd, 0) < 0)
+			eprintf("failed to truncate the dirty log of %"PRIx32
+				", %m\n", oc->vid);
+		else {
+			oc->log_records = 0;
+			oc->log_broken = 0;
+		}
+		goto out;
+	}
+
+	if (!force && !oc->log_broken &&
+	    oc->log_records < max(DIRTY_LOG_COMPACT_MIN, 2 * nr))
+		goto out;
+
+	if (dirty_log_rewrite(oc, nr) == 0)
+		oc->log_broken = 0;
+out:
+	pthread_rwlock_unlock(&oc->log_lock);
+	return nr;
 }
 
 static inline struct object_cache_entry *
@@ -275,6 +552,134 @@ alloc_cache_entry(uint32_t idx, uint64_t bmap, int create)
 	return entry;
 }
 
+static void mark_cache_object_dirty(struct object_cache *oc, uint32_t idx,
+				    uint64_t bmap, int create)
+{
+	struct dirty_stripe *stripe = stripe_of(oc, idx);
+	struct object_cache_entry *entry;
+
+	pthread_mutex_lock(&stripe->lock);
+	entry = dirty_tree_search(&stripe->tree, idx);
+	if (!entry) {
+		entry = alloc_cache_entry(idx, 0, 0);
+		dirty_tree_insert(&stripe->tree, entry);
+	}
+	entry->bmap |= bmap;
+	entry->create |= create;
+	if (!entry->queued)
+		push_dirty_entry(oc, entry);
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+/*
+ * Log the blocks of idx before they are written, so that the log covers
+ * every write which may have reached the cache file. Blocks which are
+ * dirty already have a record in the log. The log_lock is held for
+ * reading until dirty_log_end(), so compaction can't drop the record
+ * before the entry is marked dirty.
+ */
+static void dirty_log_begin(struct object_cache *oc, uint32_t idx,
+			    uint64_t bmap, int create)
+{
+	struct dirty_stripe *stripe = stripe_of(oc, idx);
+	struct object_cache_entry *entry;
+	int logged;
+
+	pthread_rwlock_rdlock(&oc->log_lock);
+
+	pthread_mutex_lock(&stripe->lock);
+	entry = dirty_tree_search(&stripe->tree, idx);
+	logged = entry && (entry->bmap & bmap) == bmap &&
+		(!create || entry->create);
+	pthread_mutex_unlock(&stripe->lock);
+
+	if (!logged)
+		dirty_log_write(oc, idx, bmap, create);
+}
+
+static void dirty_log_end(struct object_cache *oc, uint32_t idx,
+			  uint64_t bmap, int create, int written)
+{
+	if (written)
+		mark_cache_object_dirty(oc, idx, bmap, create);
+	pthread_rwlock_unlock(&oc->log_lock);
+}
+
+static inline uint32_t cache_object_size(uint32_t idx)
+{
+	if (idx_has_vdi_bit(idx))
+		return SD_INODE_SIZE;
+	else
+		return SD_DATA_OBJ_SIZE;
+}
+
+static inline struct mem_bucket *mem_bucket_of(uint32_t vid, uint32_t idx,
+					       uint32_t blk)
+{
+	uint64_t key = ((uint64_t)vid << 32 | idx) + ((uint64_t)blk << 20);
+
+	return mem_tier.buckets + hash_64(key, MEM_HASH_BITS);
+}
+
+/* Caller should hold the mem_tier.lock */
+static struct mem_block *mem_block_lookup(struct mem_bucket *bucket,
+					  uint32_t vid, uint32_t idx,
+					  uint32_t blk)
+{
+	struct mem_block *b;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(b, node, &bucket->head, hash) {
+		if (b->vid == vid && b->idx == idx && b->blk == blk)
+			return b;
+	}
+	return NULL;
+}
+
+static void mem_tier_invalidate(uint32_t vid, uint32_t idx, size_t count,
+				off_t offset)
+{
+	struct mem_bucket *bucket;
+	struct mem_block *b;
+	uint32_t blk, end;
+
+	if (!mem_tier.nr_blocks)
+		return;
+
+	end = DIV_ROUND_UP(offset + count, CACHE_BLOCK_SIZE);
+	pthread_mutex_lock(&mem_tier.lock);
+	for (blk = offset / CACHE_BLOCK_SIZE; blk < end; blk++) {
+		bucket = mem_bucket_of(vid, idx, blk);
+		bucket->gen++;
+		b = mem_block_lookup(bucket, vid, idx, blk);
+		if (b) {
+			hlist_del(&b->hash);
+			list_move(&b->list, &mem_tier.free);
+		}
+	}
+	pthread_mutex_unlock(&mem_tier.lock);
+}
+
+static void mem_tier_purge(uint32_t vid)
+{
+	struct mem_block *b, *t;
+	int i;
+
+	if (!mem_tier.nr_blocks)
+		return;
+
+	pthread_mutex_lock(&mem_tier.lock);
+	for (i = 0; i < MEM_HASH_SIZE; i++)
+		mem_tier.buckets[i].gen++;
+	list_for_each_entry_safe(b, t, &mem_tier.lru, list) {
+		if (b->vid != vid)
+			continue;
+		hlist_del(&b->hash);
+		list_move(&b->list, &mem_tier.free);
+	}
+	pthread_mutex_unlock(&mem_tier.lock);
+}
+
 static int object_cache_lookup(struct object_cache *oc, uint32_t idx,
 			       int create)
 {
@@ -295,25 +700,14 @@ static int object_cache_lookup(struct object_cache *oc, uint32_t idx,
 	}
 
 	if (create) {
-		struct object_cache_entry *entry;
-		unsigned data_length;
-
-		if (idx_has_vdi_bit(idx))
-			data_length = SD_INODE_SIZE;
-		else
-			data_length = SD_DATA_OBJ_SIZE;
+		unsigned data_length = cache_object_size(idx);
 
+		mem_tier_invalidate(oc->vid, idx, data_length, 0);
+		dirty_log_begin(oc, idx, UINT64_MAX, 1);
 		ret = prealloc(fd, data_length);
+		dirty_log_end(oc, idx, UINT64_MAX, 1, ret == SD_RES_SUCCESS);
 		if (ret != SD_RES_SUCCESS)
 			ret = -1;
-		else {
-			uint64_t bmap = UINT64_MAX;
-
-			entry = alloc_cache_entry(idx, bmap, 1);
-			pthread_mutex_lock(&oc->lock);
-			add_to_dirty_tree_and_list(oc, entry);
-			pthread_mutex_unlock(&oc->lock);
-		}
 	}
 	close(fd);
 out:
@@ -412,6 +806,123 @@ out:
 	return ret;
 }
 
+/* Take a free block or evict the least recently used one */
+static struct mem_block *mem_block_get(void)
+{
+	struct mem_block *b;
+
+	if (!list_empty(&mem_tier.free))
+		b = list_first_entry(&mem_tier.free, struct mem_block, list);
+	else if (!list_empty(&mem_tier.lru)) {
+		b = list_entry(mem_tier.lru.prev, struct mem_block, list);
+		hlist_del(&b->hash);
+	} else
+		return NULL; /* every block is being filled */
+
+	list_del(&b->list);
+	return b;
+}
+
+static int mem_block_read(uint32_t vid, uint32_t idx, uint32_t blk,
+			  char *buf, size_t count, off_t offset)
+{
+	struct mem_bucket *bucket = mem_bucket_of(vid, idx, blk);
+	off_t blk_off = (off_t)blk * CACHE_BLOCK_SIZE;
+	uint64_t gen, len;
+	struct mem_block *b;
+	int ret;
+
+	pthread_mutex_lock(&mem_tier.lock);
+	b = mem_block_lookup(bucket, vid, idx, blk);
+	if (b) {
+		memcpy(buf, b->data + offset, count);
+		list_move(&b->list, &mem_tier.lru);
+		pthread_mutex_unlock(&mem_tier.lock);
+		return SD_RES_SUCCESS;
+	}
+	gen = bucket->gen;
+	b = mem_block_get();
+	pthread_mutex_unlock(&mem_tier.lock);
+
+	if (!b)
+		return read_cache_object(vid, idx, buf, count,
+					 blk_off + offset);
+
+	len = min(CACHE_BLOCK_SIZE, cache_object_size(idx) - (uint64_t)blk_off);
+	ret = read_cache_object(vid, idx, b->data, len, blk_off);
+	if (ret == SD_RES_SUCCESS)
+		memcpy(buf, b->data + offset, count);
+
+	pthread_mutex_lock(&mem_tier.lock);
+	if (ret == SD_RES_SUCCESS && bucket->gen == gen &&
+	    !mem_block_lookup(bucket, vid, idx, blk)) {
+		b->vid = vid;
+		b->idx = idx;
+		b->blk = blk;
+		hlist_add_head(&b->hash, &bucket->head);
+		list_add(&b->list, &mem_tier.lru);
+	} else
+		list_add(&b->list, &mem_tier.free);
+	pthread_mutex_unlock(&mem_tier.lock);
+
+	return ret;
+}
+
+static int mem_tier_read(uint32_t vid, uint32_t idx, char *buf,
+			 size_t count, off_t offset)
+{
+	uint32_t blk, start, end;
+	off_t pos = offset, blk_end;
+	size_t len;
+	int ret = SD_RES_SUCCESS;
+
+	if (!mem_tier.nr_blocks)
+		return read_cache_object(vid, idx, buf, count, offset);
+
+	start = offset / CACHE_BLOCK_SIZE;
+	end = DIV_ROUND_UP(offset + count, CACHE_BLOCK_SIZE);
+	for (blk = start; blk < end; blk++) {
+		blk_end = (off_t)(blk + 1) * CACHE_BLOCK_SIZE;
+		len = min(blk_end, (off_t)(offset + count)) - pos;
+		ret = mem_block_read(vid, idx, blk, buf + (pos - offset), len,
+				     pos % CACHE_BLOCK_SIZE);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		pos += len;
+	}
+	return ret;
+}
+
+static int mem_tier_init(uint64_t size)
+{
+	size_t i, nr = size / CACHE_BLOCK_SIZE;
+	char *pool;
+
+	if (!nr)
+		return 0;
+
+	pool = mmap(NULL, nr * CACHE_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pool == MAP_FAILED) {
+		eprintf("failed to allocate memory tier, %m\n");
+		return -1;
+	}
+#ifdef MADV_HUGEPAGE
+	if (madvise(pool, nr * CACHE_BLOCK_SIZE, MADV_HUGEPAGE) < 0)
+		dprintf("no huge pages for memory tier, %m\n");
+#endif
+
+	mem_tier.blocks = xzalloc(nr * sizeof(*mem_tier.blocks));
+	for (i = 0; i < nr; i++) {
+		mem_tier.blocks[i].data = pool + i * CACHE_BLOCK_SIZE;
+		list_add_tail(&mem_tier.blocks[i].list, &mem_tier.free);
+	}
+	mem_tier.nr_blocks = nr;
+
+	vprintf(SDOG_INFO, "memory tier of %zu blocks\n", nr);
+	return 0;
+}
+
 static int object_cache_rw(struct object_cache *oc, uint32_t idx,
 			   struct request *req)
 {
@@ -423,20 +934,22 @@ static int object_cache_rw(struct object_cache *oc, uint32_t idx,
 		hdr->data_length, hdr->obj.offset);
 
 	if (hdr->flags & SD_FLAG_CMD_WRITE) {
-		struct object_cache_entry *entry;
-
+		bmap = calc_object_bmap(hdr->data_length, hdr->obj.offset);
+		/*
+		 * Invalidate both before and after the write so that a fill
+		 * which raced with it can't leave a stale block behind.
+		 */
+		mem_tier_invalidate(oc->vid, idx, hdr->data_length,
+				    hdr->obj.offset);
+		dirty_log_begin(oc, idx, bmap, 0);
 		ret = write_cache_object(oc->vid, idx, req->data,
 					 hdr->data_length, hdr->obj.offset);
-		if (ret != SD_RES_SUCCESS)
-			goto out;
-		bmap = calc_object_bmap(hdr->data_length, hdr->obj.offset);
-		entry = alloc_cache_entry(idx, bmap, 0);
-		pthread_mutex_lock(&oc->lock);
-		add_to_dirty_tree_and_list(oc, entry);
-		pthread_mutex_unlock(&oc->lock);
+		dirty_log_end(oc, idx, bmap, 0, ret == SD_RES_SUCCESS);
+		mem_tier_invalidate(oc->vid, idx, hdr->data_length,
+				    hdr->obj.offset);
 	} else {
-		ret = read_cache_object(oc->vid, idx, req->data,
-					hdr->data_length, hdr->obj.offset);
+		ret = mem_tier_read(oc->vid, idx, req->data,
+				    hdr->data_length, hdr->obj.offset);
 		if (ret != SD_RES_SUCCESS)
 			goto out;
 		req->rp.data_length = hdr->data_length;
@@ -445,49 +958,50 @@ out:
 	return ret;
 }
 
+/*
+ * Cache a pulled object unless the file exists already. The data goes to a
+ * temporary file which is then linked into place, so a guest write or read
+ * racing with a background pull never sees a partially written object and
+ * is never overwritten by the pulled data. The temporary name starts with
+ * a dot to keep it out of the directory scans.
+ */
 static int create_cache_object(struct object_cache *oc, uint32_t idx,
 			       void *buffer, size_t buf_size)
 {
-	int flags = def_open_flags | O_CREAT | O_EXCL, fd, ret = SD_RES_SUCCESS;
-	struct strbuf buf;
+	int flags = def_open_flags | O_CREAT | O_TRUNC, fd, ret = SD_RES_EIO;
+	struct strbuf buf = STRBUF_INIT, tmp = STRBUF_INIT;
 
-	strbuf_init(&buf, PATH_MAX);
-	strbuf_addstr(&buf, cache_dir);
-	strbuf_addf(&buf, "/%06"PRIx32"/%08"PRIx32, oc->vid, idx);
+	strbuf_addf(&buf, "%s/%06"PRIx32"/%08"PRIx32, cache_dir, oc->vid, idx);
+	strbuf_addf(&tmp, "%s/%06"PRIx32"/.%08"PRIx32".tmp.%ld", cache_dir,
+		    oc->vid, idx, syscall(SYS_gettid));
 
-	fd = open(buf.buf, flags, def_fmode);
+	fd = open(tmp.buf, flags, def_fmode);
 	if (fd < 0) {
-		if (errno == EEXIST) {
-			dprintf("%08"PRIx32" already created\n", idx);
-			goto out;
-		}
-		dprintf("%m\n");
-		ret = SD_RES_EIO;
+		eprintf("%s, %m\n", tmp.buf);
 		goto out;
 	}
 
-	if (flock(fd, LOCK_EX) < 0) {
-		ret = SD_RES_EIO;
-		eprintf("%m\n");
-		goto out_close;
-	}
-	ret = xpwrite(fd, buffer, buf_size, 0);
-	if (flock(fd, LOCK_UN) < 0) {
-		ret = SD_RES_EIO;
-		eprintf("%m\n");
-		goto out_close;
+	if (xpwrite(fd, buffer, buf_size, 0) != buf_size) {
+		eprintf("failed, vid %"PRIx32", idx %"PRIx32", %m\n", oc->vid,
+			idx);
+		goto out_unlink;
 	}
 
-	if (ret != buf_size) {
-		ret = SD_RES_EIO;
-		eprintf("failed, vid %"PRIx32", idx %"PRIx32"\n", oc->vid, idx);
-		goto out_close;
+	if (link(tmp.buf, buf.buf) < 0) {
+		if (errno == EEXIST) {
+			dprintf("%08"PRIx32" already created\n", idx);
+			ret = SD_RES_SUCCESS;
+		} else
+			eprintf("%s, %m\n", buf.buf);
+		goto out_unlink;
 	}
 	ret = SD_RES_SUCCESS;
 	dprintf("%08"PRIx32" size %zu\n", idx, buf_size);
-out_close:
+out_unlink:
+	unlink(tmp.buf);
 	close(fd);
 out:
+	strbuf_release(&tmp);
 	strbuf_release(&buf);
 	return ret;
 }
@@ -602,34 +1116,60 @@ out:
 /* Push back all the dirty objects to sheep cluster storage */
 static int object_cache_push(struct object_cache *oc)
 {
-	struct object_cache_entry *entry, *t;
-	struct rb_root *inactive_dirty_tree;
-	struct list_head *inactive_dirty_list;
-	int ret = SD_RES_SUCCESS;
+	struct object_cache_entry *entry, *next;
+	struct dirty_stripe *stripe;
+	uint64_t bmap;
+	int create, ret = SD_RES_SUCCESS;
 
 	if (node_in_recovery())
 		/* We don't do flushing in recovery */
 		return SD_RES_SUCCESS;
 
-	switch_dirty_tree_and_list(oc, &inactive_dirty_tree,
-				   &inactive_dirty_list);
+	entry = uatomic_xchg(&oc->dirty_stack, NULL);
+	if (!entry)
+		return SD_RES_SUCCESS;
 
 	/* 1. for async flush, there is only one worker
 	 * 2. for sync flush, Guest assure us of that only one sync
 	 * request is issued in one of gateway worker threads
-	 * So we need not to protect inactive dirty tree and list */
-	list_for_each_entry_safe(entry, t, inactive_dirty_list, list) {
-		ret = push_cache_object(oc->vid, entry->idx,
-					entry->bmap, entry->create);
-		if (ret != SD_RES_SUCCESS)
-			goto push_failed;
-		del_from_dirty_tree_and_list(entry, inactive_dirty_tree);
-		free(entry);
+	 * So we need not to protect the taken entries against other pushers.
+	 *
+	 * Dirty bits are cleared before the data is read, so a write racing
+	 * with the push marks the entry dirty again for the next one. */
+	for (; entry; entry = next) {
+		next = entry->next_dirty;
+		stripe = stripe_of(oc, entry->idx);
+
+		pthread_mutex_lock(&stripe->lock);
+		bmap = entry->bmap;
+		create = entry->create;
+		entry->bmap = 0;
+		entry->create = 0;
+		entry->queued = 0;
+		pthread_mutex_unlock(&stripe->lock);
+
+		if (ret == SD_RES_SUCCESS)
+			ret = push_cache_object(oc->vid, entry->idx, bmap,
+						create);
+		if (ret != SD_RES_SUCCESS) {
+			/* the log still covers these, don't log them again */
+			mark_cache_object_dirty(oc, entry->idx, bmap, create);
+			continue;
+		}
+
+		pthread_mutex_lock(&stripe->lock);
+		if (!entry->queued) {
+			rb_erase(&entry->rb, &stripe->tree);
+			free(entry);
+		}
+		pthread_mutex_unlock(&stripe->lock);
 	}
-	return ret;
-push_failed:
-	merge_dirty_tree_and_list(oc, inactive_dirty_tree,
-				  inactive_dirty_list);
+
+	if (ret == SD_RES_SUCCESS)
+		dirty_log_compact(oc, 0);
+	else
+		eprintf("failed to push vdi %"PRIx32", %x\n", oc->vid, ret);
+
 	return ret;
 }
 
@@ -655,29 +1195,139 @@ void object_cache_delete(uint32_t vid)
 
 	cache = find_object_cache(vid, 0);
 	if (cache) {
-		int h = hash(vid);
-		struct object_cache_entry *entry, *t;
+		struct object_cache_entry *entry;
 		struct strbuf buf = STRBUF_INIT;
+		struct rb_node *n;
+		int i;
 
 		/* Firstly we free memeory */
-		pthread_mutex_lock(&hashtable_lock[h]);
+		pthread_rwlock_wrlock(&cache_index.lock);
 		hlist_del(&cache->hash);
-		pthread_mutex_unlock(&hashtable_lock[h]);
-
-		list_for_each_entry_safe(entry, t, cache->active_dirty_list, list) {
-			free(entry);
+		cache_index.nr--;
+		pthread_rwlock_unlock(&cache_index.lock);
+
+		for (i = 0; i < DIRTY_STRIPES; i++) {
+			while ((n = rb_first(&cache->stripes[i].tree))) {
+				entry = rb_entry(n, struct object_cache_entry,
+						 rb);
+				rb_erase(n, &cache->stripes[i].tree);
+				free(entry);
+			}
 		}
+		if (cache->log_fd >= 0)
+			close(cache->log_fd);
 		free(cache);
 
+		mem_tier_purge(vid);
+
 		/* Then we free disk */
 		strbuf_addf(&buf, "%s/%06"PRIx32, cache_dir, vid);
 		rmdir_r(buf.buf);
+		strbuf_reset(&buf);
+		get_warmup_path(&buf, vid);
+		unlink(buf.buf);
 
 		strbuf_release(&buf);
 	}
 
 }
 
+static void save_warmup_list(uint32_t vid, uint32_t *cached, int nr)
+{
+	struct strbuf buf = STRBUF_INIT;
+	size_t len = nr * sizeof(*cached);
+	int fd;
+
+	if (!nr)
+		return;
+
+	get_warmup_path(&buf, vid);
+	fd = open(buf.buf, O_WRONLY | O_CREAT | O_TRUNC, def_fmode);
+	if (fd < 0) {
+		eprintf("%s, %m\n", buf.buf);
+		goto out;
+	}
+	if (xwrite(fd, cached, len) != len) {
+		eprintf("%s, %m\n", buf.buf);
+		unlink(buf.buf);
+	}
+	close(fd);
+out:
+	strbuf_release(&buf);
+}
+
+/* Sleep as long as needed to keep the pull rate under WARMUP_RATE */
+static void warmup_throttle(uint64_t start, uint64_t bytes)
+{
+	uint64_t elapsed, expected;
+
+	elapsed = monotonic_usec() - start;
+	expected = bytes * 1000000 / WARMUP_RATE;
+	if (expected > elapsed)
+		usleep(expected - elapsed);
+}
+
+static void do_warmup(struct work *work)
+{
+	struct warmup_work *ww = container_of(work, struct warmup_work, work);
+	struct strbuf buf = STRBUF_INIT;
+	struct object_cache *oc;
+	uint64_t start, bytes = 0;
+	uint32_t idx;
+	int fd, nr = 0;
+
+	get_warmup_path(&buf, ww->vid);
+	fd = open(buf.buf, O_RDONLY);
+	if (fd < 0)
+		goto out; /* already warmed up by an earlier work */
+	unlink(buf.buf);
+
+	start = monotonic_usec();
+	while (xread(fd, &idx, sizeof(idx)) == sizeof(idx)) {
+		/* The cache could be dropped while we are warming it up */
+		oc = find_object_cache(ww->vid, 0);
+		if (!oc)
+			break;
+		if (object_cache_lookup(oc, idx, 0) == 0)
+			continue;
+		if (object_cache_pull(oc, idx) != SD_RES_SUCCESS)
+			continue;
+
+		nr++;
+		bytes += cache_object_size(idx);
+		warmup_throttle(start, bytes);
+	}
+	close(fd);
+	dprintf("vdi %"PRIx32", %d objects pulled\n", ww->vid, nr);
+out:
+	strbuf_release(&buf);
+}
+
+static void warmup_done(struct work *work)
+{
+	struct warmup_work *ww = container_of(work, struct warmup_work, work);
+
+	free(ww);
+}
+
+static void start_warmup(uint32_t vid)
+{
+	struct strbuf buf = STRBUF_INIT;
+	struct warmup_work *ww;
+
+	get_warmup_path(&buf, vid);
+	if (access(buf.buf, F_OK) < 0)
+		goto out;
+
+	ww = xzalloc(sizeof(*ww));
+	ww->vid = vid;
+	ww->work.fn = do_warmup;
+	ww->work.done = warmup_done;
+	queue_work(sys->warmup_wqueue, &ww->work);
+out:
+	strbuf_release(&buf);
+}
+
 static int object_cache_flush_and_delete(struct object_cache *oc)
 {
 	DIR *dir;
@@ -685,6 +1335,8 @@ static int object_cache_flush_and_delete(struct object_cache *oc)
 	uint32_t vid = oc->vid;
 	uint32_t idx;
 	uint64_t all = UINT64_MAX;
+	uint32_t *cached = NULL;
+	int nr = 0, alloced = 0;
 	struct strbuf p;
 	int ret = 0;
 
@@ -711,12 +1363,21 @@ static int object_cache_flush_and_delete(struct object_cache *oc)
 			dprintf("failed to push %"PRIx64"\n",
 				idx_to_oid(vid, idx));
 			ret = -1;
-			goto out;
+			goto out_close;
+		}
+		if (nr == alloced) {
+			alloced = alloced ? alloced * 2 : 64;
+			cached = xrealloc(cached, alloced * sizeof(*cached));
 		}
+		cached[nr++] = idx;
 	}
 
 	object_cache_delete(vid);
+	save_warmup_list(vid, cached, nr);
+out_close:
+	closedir(dir);
 out:
+	free(cached);
 	strbuf_release(&p);
 	return ret;
 }
@@ -763,7 +1424,11 @@ int object_cache_handle_request(struct request *req)
 	struct object_cache *cache;
 	int ret, create = 0;
 
-	cache = find_object_cache(vid, 1);
+	cache = find_object_cache(vid, 0);
+	if (!cache) {
+		cache = find_object_cache(vid, 1);
+		start_warmup(vid);
+	}
 
 	if (req->rq.opcode == SD_OP_CREATE_AND_WRITE_OBJ)
 		create = 1;
@@ -870,24 +1535,90 @@ void object_cache_remove(uint64_t oid)
 	uint32_t idx = object_cache_oid_to_idx(oid);
 	struct object_cache *oc;
 	struct object_cache_entry *entry;
-	int tree_id = 0;
+	struct dirty_stripe *stripe;
 
 	oc = find_object_cache(vid, 0);
 	if (!oc)
 		return;
 
-	pthread_mutex_lock(&oc->lock);
-	entry = dirty_tree_search(&oc->dirty_trees[tree_id], idx);
-	if (!entry) {
-		tree_id = 1;
-		entry = dirty_tree_search(&oc->dirty_trees[tree_id], idx);
+	stripe = stripe_of(oc, idx);
+	pthread_mutex_lock(&stripe->lock);
+	entry = dirty_tree_search(&stripe->tree, idx);
+	if (entry) {
+		/* a queued entry is dropped by the next push */
+		entry->bmap = 0;
+		entry->create = 0;
 	}
-	if (!entry)
+	pthread_mutex_unlock(&stripe->lock);
+
+	if (entry)
+		dirty_log_append(oc, idx, 0, 0);
+}
+
+/* Rebuild the dirty index of oc from its dirty log */
+static int dirty_log_replay(struct object_cache *oc)
+{
+	struct strbuf buf = STRBUF_INIT;
+	struct object_cache_entry *entry;
+	struct dirty_stripe *stripe;
+	struct dirty_log_entry e;
+	int fd;
+
+	get_dirty_log_path(&buf, oc->vid);
+	fd = open(buf.buf, O_RDONLY);
+	if (fd < 0)
 		goto out;
-	del_from_dirty_tree_and_list(entry, &oc->dirty_trees[tree_id]);
+
+	while (xread(fd, &e, sizeof(e)) == sizeof(e)) {
+		if (e.bmap) {
+			/* The cache file might be gone with the crash */
+			if (object_cache_lookup(oc, e.idx, 0) == 0)
+				mark_cache_object_dirty(oc, e.idx, e.bmap,
+							e.create);
+			continue;
+		}
+
+		stripe = stripe_of(oc, e.idx);
+		pthread_mutex_lock(&stripe->lock);
+		entry = dirty_tree_search(&stripe->tree, e.idx);
+		if (entry) {
+			entry->bmap = 0;
+			entry->create = 0;
+		}
+		pthread_mutex_unlock(&stripe->lock);
+	}
+	close(fd);
 out:
-	pthread_mutex_unlock(&oc->lock);
-	return;
+	strbuf_release(&buf);
+	return dirty_log_compact(oc, 1);
+}
+
+static void load_object_caches(void)
+{
+	DIR *dir;
+	struct dirent *d;
+	struct object_cache *cache;
+	uint32_t vid;
+	char *end;
+	int nr;
+
+	dir = opendir(cache_dir);
+	if (!dir) {
+		eprintf("%s, %m\n", cache_dir);
+		return;
+	}
+
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, ".", 1))
+			continue;
+		vid = strtoul(d->d_name, &end, 16);
+		if (*end)
+			continue;
+		cache = find_object_cache(vid, 1);
+		nr = dirty_log_replay(cache);
+		dprintf("vdi %"PRIx32", %d dirty objects\n", vid, nr);
+	}
+	closedir(dir);
 }
 
 int object_cache_init(const char *p)
@@ -905,6 +1636,18 @@ int object_cache_init(const char *p)
 		}
 	}
 	strbuf_copyout(&buf, cache_dir, sizeof(cache_dir));
+
+	strbuf_addstr(&buf, "/"WARMUP_DIR);
+	if (mkdir(buf.buf, def_dmode) < 0) {
+		if (errno != EEXIST) {
+			eprintf("%m\n");
+			ret = -1;
+			goto err;
+		}
+	}
+	load_object_caches();
+
+	ret = mem_tier_init(sys->memcache_size);
 err:
 	strbuf_release(&buf);
 	return ret;
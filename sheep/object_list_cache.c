@@ -126,9 +126,31 @@ int objlist_cache_insert(uint64_t oid)
 	return 0;
 }
 
+/* Return the index of the first cached oid not smaller than oid */
+static int objlist_cache_buf_search(uint64_t oid)
+{
+	int lo = 0, hi = obj_list_cache.cache_size, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (obj_list_cache.buf[mid] < oid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Copy as many oids as fit in the buffer, starting at hdr->cursor. The oids
+ * are returned in ascending order, so a caller continues with the cursor we
+ * hand back even if objects are added or removed in between. Requesters
+ * which don't set SD_FLAG_CMD_PAGED ignore 'more', so they get the whole
+ * list or an error.
+ */
 int get_obj_list(const struct sd_list_req *hdr, struct sd_list_rsp *rsp, void *data)
 {
-	int nr = 0;
+	int nr = 0, start;
 	struct objlist_cache_entry *entry;
 	struct rb_node *p;
 
@@ -153,14 +175,29 @@ int get_obj_list(const struct sd_list_req *hdr, struct sd_list_rsp *rsp, void *d
 	}
 
 out:
-	if (hdr->data_length < obj_list_cache.cache_size * sizeof(uint64_t)) {
+	if (hdr->data_length < sizeof(uint64_t)) {
+		pthread_rwlock_unlock(&obj_list_cache.lock);
+		eprintf("GET_OBJ_LIST buffer too small\n");
+		return SD_RES_INVALID_PARMS;
+	}
+
+	start = objlist_cache_buf_search(hdr->cursor);
+	nr = min((size_t)(obj_list_cache.cache_size - start),
+		 hdr->data_length / sizeof(uint64_t));
+	if (start + nr < obj_list_cache.cache_size &&
+	    !(hdr->flags & SD_FLAG_CMD_PAGED)) {
 		pthread_rwlock_unlock(&obj_list_cache.lock);
 		eprintf("GET_OBJ_LIST buffer too small\n");
 		return SD_RES_EIO;
 	}
 
-	rsp->data_length = obj_list_cache.cache_size * sizeof(uint64_t);
-	memcpy(data, obj_list_cache.buf, rsp->data_length);
+	rsp->data_length = nr * sizeof(uint64_t);
+	memcpy(data, obj_list_cache.buf + start, rsp->data_length);
+	if (start + nr < obj_list_cache.cache_size) {
+		rsp->more = 1;
+		rsp->next_cursor = obj_list_cache.buf[start + nr];
+	} else
+		rsp->more = 0;
 	pthread_rwlock_unlock(&obj_list_cache.lock);
 	return SD_RES_SUCCESS;
 }
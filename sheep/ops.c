@@ -59,7 +59,7 @@ struct sd_op_template {
 	int (*process_main)(const struct sd_req *req, struct sd_rsp *rsp, void *data);
 };
 
-static int stat_sheep(uint64_t *store_size, uint64_t *store_free, uint32_t epoch)
+int stat_sheep(uint64_t *store_size, uint64_t *store_free, uint32_t epoch)
 {
 	struct statvfs vs;
 	int ret;
@@ -131,6 +131,8 @@ static int post_cluster_new_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 
 	vprintf(SDOG_INFO, "done %d %ld\n", ret, nr);
 	set_bit(nr, sys->vdi_inuse);
+	vdi_index_invalidate(nr);
+	snapshot_cache_invalidate(nr);
 
 	return SD_RES_SUCCESS;
 }
@@ -154,6 +156,16 @@ static int cluster_del_vdi(struct request *req)
 	return ret;
 }
 
+static int post_cluster_del_vdi(const struct sd_req *req, struct sd_rsp *rsp,
+				void *data)
+{
+	vdi_index_mark_deleting(rsp->vdi.vdi_id);
+	add_deletion_mark(rsp->vdi.vdi_id);
+	snapshot_cache_invalidate(rsp->vdi.vdi_id);
+
+	return SD_RES_SUCCESS;
+}
+
 static int cluster_get_vdi_info(struct request *req)
 {
 	const struct sd_req *hdr = &req->rq;
@@ -186,6 +198,7 @@ static int remove_epoch(uint32_t epoch)
 	char path[PATH_MAX];
 
 	dprintf("remove epoch %"PRIu32"\n", epoch);
+	invalidate_vnode_info_epoch(epoch);
 	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
 	ret = unlink(path);
 	if (ret && ret != -ENOENT) {
@@ -216,6 +229,9 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	if (!driver)
 		return SD_RES_NO_STORE;
 
+	if (!find_placement_driver(sd_placement(hdr->flags)))
+		return SD_RES_INVALID_PARMS;
+
 	sd_store = driver;
 	latest_epoch = get_latest_epoch();
 	iocb.epoch = latest_epoch;
@@ -225,6 +241,7 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	sys->flags = hdr->flags;
 	if (!sys->nr_copies)
 		sys->nr_copies = SD_DEFAULT_REDUNDANCY;
+	refresh_vnode_info();
 
 	created_time = hdr->ctime;
 	set_cluster_ctime(created_time);
@@ -233,6 +250,8 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 		remove_epoch(i);
 
 	memset(sys->vdi_inuse, 0, sizeof(sys->vdi_inuse));
+	vdi_index_clear();
+	clear_deletion_log();
 
 	sys->epoch = 1;
 	sys->recovered_epoch = 1;
@@ -311,6 +330,12 @@ static int local_read_vdis(const struct sd_req *req, struct sd_rsp *rsp,
 	return read_vdis(data, req->data_length, &rsp->data_length);
 }
 
+static int local_read_deletions(const struct sd_req *req, struct sd_rsp *rsp,
+				void *data)
+{
+	return read_deletions(data, req->data_length, &rsp->data_length);
+}
+
 static int local_stat_sheep(struct request *req)
 {
 	struct sd_node_rsp *node_rsp = (struct sd_node_rsp *)&req->rp;
@@ -322,12 +347,18 @@ static int local_stat_sheep(struct request *req)
 static int local_stat_recovery(const struct sd_req *req, struct sd_rsp *rsp,
 					void *data)
 {
-	if (node_in_recovery())
-		return SD_RES_SUCCESS;
-	else
-		return SD_RES_UNKNOWN;
+	int len;
 
-	return SD_RES_UNKNOWN;
+	/* old clients only ask whether we are in recovery */
+	if (!req->data_length)
+		return node_in_recovery() ? SD_RES_SUCCESS : SD_RES_UNKNOWN;
+
+	len = get_recovery_stat(data, req->data_length);
+	if (len < 0)
+		return SD_RES_INVALID_PARMS;
+
+	rsp->data_length = len;
+	return SD_RES_SUCCESS;
 }
 
 static int local_stat_cluster(struct request *req)
@@ -453,6 +484,28 @@ out:
 	return ret;
 }
 
+static int cluster_set_recovery(const struct sd_req *req, struct sd_rsp *rsp,
+				void *data)
+{
+	struct recovery_throttle *rt = data;
+
+	if (req->data_length != sizeof(*rt))
+		return SD_RES_INVALID_PARMS;
+
+	set_recovery_throttle(rt->max_rate, !!rt->adaptive);
+	return SD_RES_SUCCESS;
+}
+
+static int cluster_set_deletion(const struct sd_req *req, struct sd_rsp *rsp,
+				void *data)
+{
+	if (req->data_length != sizeof(uint32_t))
+		return SD_RES_INVALID_PARMS;
+
+	set_deletion_rate(*(uint32_t *)data);
+	return SD_RES_SUCCESS;
+}
+
 static int cluster_snapshot(const struct sd_req *req, struct sd_rsp *rsp,
 			    void *data)
 {
@@ -495,6 +548,7 @@ static int cluster_restore(const struct sd_req *req, struct sd_rsp *rsp,
 		ret = sd_store->restore(&iocb);
 	else
 		ret = SD_RES_NO_SUPPORT;
+	vdi_index_clear();
 	return ret;
 }
 
@@ -554,18 +608,16 @@ static int read_copy_from_replica(struct vnode_info *vnodes, uint32_t epoch,
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
 	struct sd_vnode *v;
-	char name[128];
 	int rounded_rand, local = -1;
 
 	nr_copies = get_nr_copies(vnodes);
-	oid_to_vnodes(vnodes, oid, nr_copies, obj_vnodes);
+	nr_copies = oid_to_vnodes(vnodes, oid, nr_copies, obj_vnodes);
 
 	/* first try to read from local copy */
 	for (i = 0; i < nr_copies; i++) {
 		struct siocb iocb;
 
 		v = obj_vnodes[i];
-		addr_to_str(name, sizeof(name), v->nid.addr, 0);
 
 		if (vnode_is_local(v)) {
 			memset(&iocb, 0, sizeof(iocb));
@@ -587,7 +639,7 @@ static int read_copy_from_replica(struct vnode_info *vnodes, uint32_t epoch,
 
 	for (i = 0; i < nr_copies; i++) {
 		unsigned wlen, rlen;
-		int fd;
+		struct sockfd *sfd;
 
 		j = (i + rounded_rand) % nr_copies;
 
@@ -596,10 +648,8 @@ static int read_copy_from_replica(struct vnode_info *vnodes, uint32_t epoch,
 			continue;
 
 		v = obj_vnodes[j];
-		addr_to_str(name, sizeof(name), v->nid.addr, 0);
-
-		fd = connect_to(name, v->nid.port);
-		if (fd < 0)
+		sfd = sheep_get_sockfd(&v->nid);
+		if (!sfd)
 			continue;
 
 		rlen = SD_DATA_OBJ_SIZE;
@@ -612,14 +662,13 @@ static int read_copy_from_replica(struct vnode_info *vnodes, uint32_t epoch,
 		hdr.obj.oid = oid;
 		hdr.obj.offset = 0;
 
-		ret = exec_req(fd, &hdr, buf, &wlen, &rlen);
-
-		close(fd);
-
+		ret = exec_req(sfd->fd, &hdr, buf, &wlen, &rlen);
 		if (ret) {
+			sheep_del_sockfd(&v->nid, sfd);
 			dprintf("%x, %x\n", ret, rsp->result);
 			continue;
 		}
+		sheep_put_sockfd(&v->nid, sfd);
 
 		if (rsp->result == SD_RES_SUCCESS)
 			break;
@@ -641,6 +690,37 @@ int peer_remove_obj(struct request *req)
 	return sd_store->remove_object(oid);
 }
 
+/*
+ * Remove a batch of local objects. The oids that were not removed are sent
+ * back so that the caller can retry them through the gateway.
+ */
+static int peer_remove_objs(struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	uint64_t *oids = req->data;
+	int i, nr = hdr->data_length / sizeof(*oids), nr_left = 0, ret;
+
+	/* objects may be moving, let the gateway deal with them one by one */
+	if (hdr->epoch != sys->epoch)
+		return SD_RES_OLD_NODE_VER;
+	if (node_in_recovery())
+		return SD_RES_OBJ_RECOVERING;
+
+	for (i = 0; i < nr; i++) {
+		objlist_cache_remove(oids[i]);
+		object_cache_remove(oids[i]);
+
+		ret = sd_store->remove_object(oids[i]);
+		if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ) {
+			eprintf("failed to remove %"PRIx64", %x\n", oids[i], ret);
+			oids[nr_left++] = oids[i];
+		}
+	}
+
+	req->rp.data_length = nr_left * sizeof(*oids);
+	return SD_RES_SUCCESS;
+}
+
 int peer_read_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
@@ -665,6 +745,40 @@ out:
 	return ret;
 }
 
+static int peer_get_obj_digest(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct sd_rsp *rsp = &req->rp;
+	uint64_t oid = hdr->obj.oid;
+	uint32_t len = get_objsize(oid), size;
+	struct siocb iocb;
+	void *buf;
+	int ret;
+
+	size = DIV_ROUND_UP(len, SD_RESYNC_BLOCK_SIZE) * SHA1_LEN;
+	if (hdr->data_length < size)
+		return SD_RES_INVALID_PARMS;
+
+	buf = valloc(len);
+	if (!buf)
+		return SD_RES_NO_MEM;
+
+	memset(&iocb, 0, sizeof(iocb));
+	iocb.epoch = hdr->epoch;
+	iocb.flags = hdr->flags;
+	iocb.buf = buf;
+	iocb.length = len;
+	ret = sd_store->read(oid, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	get_block_digests(buf, len, req->data);
+	rsp->data_length = size;
+out:
+	free(buf);
+	return ret;
+}
+
 static int do_write_obj(struct siocb *iocb, struct sd_req *hdr, uint32_t epoch,
 		void *data, int create)
 {
@@ -706,7 +820,14 @@ int peer_write_obj(struct request *req)
 	return do_write_obj(&iocb, hdr, epoch, req->data, 0);
 }
 
-int peer_create_and_write_obj(struct request *req)
+/*
+ * Create obj.oid as a copy of obj.cow_oid with the payload written at
+ * obj.offset on top. When this node holds a copy of cow_oid, the store
+ * copies it locally and nothing crosses the network; otherwise the data
+ * is read from a replica. With SD_FLAG_CMD_EXCL an existing obj.oid is
+ * left as it is.
+ */
+int peer_copy_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 	struct sd_req cow_hdr;
@@ -714,43 +835,77 @@ int peer_create_and_write_obj(struct request *req)
 	uint64_t oid = hdr->obj.oid;
 	char *buf = NULL;
 	struct siocb iocb;
-	int ret = SD_RES_SUCCESS;
+	int ret;
+
+	dprintf("%" PRIx64 ", %" PRIx64 "\n", oid, hdr->obj.cow_oid);
+
+	if (!is_data_obj(oid) || !is_data_obj(hdr->obj.cow_oid) ||
+	    hdr->obj.offset + hdr->data_length > SD_DATA_OBJ_SIZE)
+		return SD_RES_INVALID_PARMS;
 
 	memset(&iocb, 0, sizeof(iocb));
 	iocb.epoch = epoch;
 	iocb.flags = hdr->flags;
-	iocb.length = get_objsize(oid);
-	if (hdr->flags & SD_FLAG_CMD_COW) {
-		dprintf("%" PRIx64 ", %" PRIx64 "\n", oid, hdr->obj.cow_oid);
 
-		buf = valloc(SD_DATA_OBJ_SIZE);
-		if (!buf) {
-			eprintf("can not allocate memory\n");
+	if (sd_store->copy) {
+		ret = sd_store->copy(hdr->obj.cow_oid, oid, &iocb);
+		if (ret == SD_RES_SUCCESS) {
+			if (hdr->data_length)
+				ret = do_write_obj(&iocb, hdr, epoch, req->data,
+						   0);
 			goto out;
 		}
-		if (hdr->data_length != SD_DATA_OBJ_SIZE) {
-			ret = read_copy_from_replica(req->vnodes, hdr->epoch,
-						     hdr->obj.cow_oid, buf);
-			if (ret != SD_RES_SUCCESS) {
-				eprintf("failed to read cow object\n");
-				goto out;
-			}
-		}
+		if (ret != SD_RES_NO_OBJ)
+			goto out;
+	}
 
-		memcpy(buf + hdr->obj.offset, req->data, hdr->data_length);
-		memcpy(&cow_hdr, hdr, sizeof(cow_hdr));
-		cow_hdr.data_length = SD_DATA_OBJ_SIZE;
-		cow_hdr.obj.offset = 0;
+	buf = valloc(SD_DATA_OBJ_SIZE);
+	if (!buf) {
+		eprintf("can not allocate memory\n");
+		ret = SD_RES_NO_MEM;
+		goto out;
+	}
+	ret = read_copy_from_replica(req->vnodes, hdr->epoch,
+				     hdr->obj.cow_oid, buf);
+	if (ret != SD_RES_SUCCESS) {
+		eprintf("failed to read cow object\n");
+		goto out;
+	}
 
-		ret = do_write_obj(&iocb, &cow_hdr, epoch, buf, 1);
-	} else
-		ret = do_write_obj(&iocb, hdr, epoch, req->data, 1);
+	memcpy(buf + hdr->obj.offset, req->data, hdr->data_length);
+	memcpy(&cow_hdr, hdr, sizeof(cow_hdr));
+	cow_hdr.data_length = SD_DATA_OBJ_SIZE;
+	cow_hdr.obj.offset = 0;
 
+	iocb.flags |= SD_FLAG_CMD_COW;
+	ret = do_write_obj(&iocb, &cow_hdr, epoch, buf, 1);
+out:
 	if (SD_RES_SUCCESS == ret)
 		objlist_cache_insert(oid);
-out:
-	if (buf)
-		free(buf);
+	free(buf);
+	return ret;
+}
+
+int peer_create_and_write_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint32_t epoch = hdr->epoch;
+	uint64_t oid = hdr->obj.oid;
+	struct siocb iocb;
+	int ret;
+
+	/* a write that covers the whole object doesn't need the old data */
+	if (hdr->flags & SD_FLAG_CMD_COW && hdr->data_length != SD_DATA_OBJ_SIZE)
+		return peer_copy_obj(req);
+
+	memset(&iocb, 0, sizeof(iocb));
+	iocb.epoch = epoch;
+	iocb.flags = hdr->flags;
+	iocb.length = get_objsize(oid);
+	ret = do_write_obj(&iocb, hdr, epoch, req->data, 1);
+	if (SD_RES_SUCCESS == ret)
+		objlist_cache_insert(oid);
+
 	return ret;
 }
 
@@ -766,6 +921,7 @@ static struct sd_op_template sd_ops[] = {
 	[SD_OP_DEL_VDI] = {
 		.type = SD_OP_TYPE_CLUSTER,
 		.process_work = cluster_del_vdi,
+		.process_main = post_cluster_del_vdi,
 	},
 
 	[SD_OP_GET_VDI_INFO] = {
@@ -804,6 +960,16 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = cluster_manual_recover,
 	},
 
+	[SD_OP_SET_RECOVERY] = {
+		.type = SD_OP_TYPE_CLUSTER,
+		.process_main = cluster_set_recovery,
+	},
+
+	[SD_OP_SET_DELETION] = {
+		.type = SD_OP_TYPE_CLUSTER,
+		.process_main = cluster_set_deletion,
+	},
+
 	[SD_OP_SNAPSHOT] = {
 		.type = SD_OP_TYPE_CLUSTER,
 		.force = 1,
@@ -835,6 +1001,12 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_read_vdis,
 	},
 
+	[SD_OP_READ_DELETIONS] = {
+		.type = SD_OP_TYPE_LOCAL,
+		.force = 1,
+		.process_main = local_read_deletions,
+	},
+
 	[SD_OP_GET_NODE_LIST] = {
 		.type = SD_OP_TYPE_LOCAL,
 		.force = 1,
@@ -922,6 +1094,11 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = peer_create_and_write_obj,
 	},
 
+	[SD_OP_COPY_OBJ] = {
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_copy_obj,
+	},
+
 	[SD_OP_READ_PEER] = {
 		.type = SD_OP_TYPE_PEER,
 		.process_work = peer_read_obj,
@@ -936,6 +1113,16 @@ static struct sd_op_template sd_ops[] = {
 		.type = SD_OP_TYPE_PEER,
 		.process_work = peer_remove_obj,
 	},
+
+	[SD_OP_GET_OBJ_DIGEST] = {
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_get_obj_digest,
+	},
+
+	[SD_OP_REMOVE_OBJS] = {
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_remove_objs,
+	},
 };
 
 struct sd_op_template *get_sd_op(uint8_t opcode)
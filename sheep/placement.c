@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Placement drivers
+ *
+ * A placement driver decides which vnodes hold the copies of an object.
+ * The driver is chosen when the cluster is formatted and carried in the
+ * cluster flags, so every node and every epoch uses the same one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sheep_priv.h"
+
+LIST_HEAD(placement_drivers);
+
+/*
+ * Number of copies every ring position can hold: each non-zero zone counts
+ * once and each node of zone 0 counts on its own, like get_nth_node() does.
+ */
+static int get_replicas_nr(struct vnode_info *vnode_info)
+{
+	uint32_t zones[SD_MAX_REDUNDANCY];
+	int nr = 0, nr_zones = 0, i, j;
+
+	for (i = 0; i < vnode_info->nr_nodes && nr < SD_MAX_REDUNDANCY; i++) {
+		struct sd_node *n = &vnode_info->nodes[i];
+
+		if (!n->nr_vnodes)
+			continue;
+
+		if (n->zone) {
+			for (j = 0; j < nr_zones; j++) {
+				if (zones[j] == n->zone)
+					break;
+			}
+			if (j < nr_zones)
+				continue;
+			zones[nr_zones++] = n->zone;
+		}
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * Walk the ring once per position and remember where each copy goes, so
+ * that a lookup is a hash, a binary search and an array read.
+ */
+static void ring_init(struct vnode_info *vnode_info)
+{
+	struct sd_vnode *e = vnode_info->vnodes;
+	int nr_vnodes = vnode_info->nr_vnodes;
+	int nr_replicas = get_replicas_nr(vnode_info);
+	int base, idx, nr, i;
+	uint32_t *r;
+
+	if (!nr_vnodes || !nr_replicas)
+		return;
+
+	vnode_info->placement_table = xmalloc(sizeof(uint32_t) * nr_vnodes *
+					      nr_replicas);
+	vnode_info->placement_width = nr_replicas;
+
+	for (base = 0; base < nr_vnodes; base++) {
+		r = vnode_info->placement_table + base * nr_replicas;
+		r[0] = base;
+		idx = base;
+		for (nr = 1; nr < nr_replicas; nr++) {
+next:
+			idx = (idx + 1) % nr_vnodes;
+			for (i = 0; i < nr; i++) {
+				if (same_node(e, idx, r[i]) ||
+				    same_zone(e, idx, r[i]))
+					goto next;
+			}
+			r[nr] = idx;
+		}
+	}
+}
+
+static int ring_oid_to_vnodes(struct vnode_info *vnode_info, uint64_t oid,
+			      int nr_copies, int *idxs)
+{
+	int pos, i;
+	uint32_t *r;
+
+	if (nr_copies > vnode_info->placement_width) {
+		obj_to_sheeps(vnode_info->vnodes, vnode_info->nr_vnodes,
+			      oid, nr_copies, idxs);
+		return nr_copies;
+	}
+
+	pos = get_ring_pos(vnode_info->vnode_ids, vnode_info->nr_vnodes, oid);
+	pos = (pos + 1) % vnode_info->nr_vnodes;
+	r = vnode_info->placement_table + pos * vnode_info->placement_width;
+	for (i = 0; i < nr_copies; i++)
+		idxs[i] = r[i];
+
+	return nr_copies;
+}
+
+static struct placement_driver ring = {
+	.name = "ring",
+	.id = SD_PLACEMENT_RING,
+	.init = ring_init,
+	.oid_to_vnodes = ring_oid_to_vnodes,
+};
+
+add_placement_driver(ring);
+
+/* Map every node to one of its vnodes, which is what callers get back */
+static void straw2_init(struct vnode_info *vnode_info)
+{
+	struct sd_node key, *n;
+	int i;
+
+	vnode_info->placement_table = xzalloc(sizeof(uint32_t) *
+					      vnode_info->nr_nodes);
+
+	for (i = vnode_info->nr_vnodes - 1; i >= 0; i--) {
+		memset(&key, 0, sizeof(key));
+		key.nid = vnode_info->vnodes[i].nid;
+		n = bsearch(&key, vnode_info->nodes, vnode_info->nr_nodes,
+			    sizeof(key), node_id_cmp);
+		if (n)
+			vnode_info->placement_table[n - vnode_info->nodes] = i;
+	}
+}
+
+static int straw2_oid_to_vnodes(struct vnode_info *vnode_info, uint64_t oid,
+				int nr_copies, int *idxs)
+{
+	int i, nr;
+
+	nr = obj_to_nodes_straw2(vnode_info->nodes, vnode_info->nr_nodes,
+				 oid, nr_copies, idxs);
+	if (nr < nr_copies)
+		dprintf("only %d zones for %d copies of %" PRIx64 "\n",
+			nr, nr_copies, oid);
+
+	for (i = 0; i < nr; i++)
+		idxs[i] = vnode_info->placement_table[idxs[i]];
+
+	return nr;
+}
+
+static struct placement_driver straw2 = {
+	.name = "straw2",
+	.id = SD_PLACEMENT_STRAW2,
+	.init = straw2_init,
+	.oid_to_vnodes = straw2_oid_to_vnodes,
+};
+
+add_placement_driver(straw2);
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 #include "sheep_priv.h"
@@ -26,7 +27,7 @@ struct recovery_work {
 	enum rw_state state;
 
 	uint32_t epoch;
-	uint32_t done;
+	uint32_t done; /* index of the next object to be scheduled */
 
 	int stop;
 	struct work work;
@@ -36,13 +37,307 @@ struct recovery_work {
 	uint64_t *prio_oids;
 	int nr_prio_oids;
 
+	/* object list fetch, see start_fetch_object_lists() */
+	int next_node;
+	int nr_fetching;
+
+	/* objects being recovered, at most sys->recovery_window of them */
+	uint64_t inflight[SD_MAX_RECOVERY_WINDOW];
+	int nr_inflight;
+
 	struct vnode_info *old_vnodes;
 	struct vnode_info *cur_vnodes;
 };
 
+struct recovery_obj_work {
+	struct recovery_work *rw;
+	uint64_t oid;
+	int failed;
+	struct work work;
+};
+
+/* Fetches one node's object list and screens out what isn't ours */
+struct object_list_work {
+	struct recovery_work *rw;
+	struct sd_node *node;
+	int count;
+	uint64_t *oids;
+	struct work work;
+};
+
+/* Bytes of oids asked for in each SD_OP_GET_OBJ_LIST request */
+#define OBJ_LIST_CHUNK		(1024 * 1024)
+/* Nodes whose object lists are fetched at the same time */
+#define OBJ_LIST_PARALLEL	16
+
 static struct recovery_work *next_rw;
 static struct recovery_work *recovering_work;
 
+/* Foreground request latency above which adaptive throttling backs off */
+#define THROTTLE_LATENCY_TARGET	(20 * 1000) /* usec */
+/* A latency sample older than this no longer describes the load */
+#define THROTTLE_LATENCY_STALE	(1000 * 1000) /* usec */
+#define THROTTLE_ADJUST_INTERVAL	(100 * 1000) /* usec */
+#define THROTTLE_MIN_RATE	(1024 * 1024) /* bytes per second */
+
+/*
+ * Token bucket limiting the bytes recovered per second. In adaptive mode
+ * the rate is halved whenever gateway and peer requests take too long from
+ * being queued to being done, and raised step by step back to max_rate
+ * once they don't.
+ */
+static struct {
+	pthread_mutex_t lock;
+	uint64_t max_rate; /* bytes per second, 0 means unlimited */
+	bool adaptive;
+	uint64_t rate;
+	int64_t tokens;
+	uint64_t last_refill;
+	uint64_t last_adjust;
+
+	uint64_t latency; /* moving average of foreground request latency */
+	uint64_t last_sample;
+} throttle = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void set_recovery_throttle(uint32_t max_rate, bool adaptive)
+{
+	pthread_mutex_lock(&throttle.lock);
+	throttle.max_rate = (uint64_t)max_rate * 1024 * 1024;
+	uatomic_set(&throttle.adaptive, adaptive);
+	throttle.rate = throttle.max_rate;
+	throttle.tokens = 0;
+	throttle.last_refill = throttle.last_adjust = monotonic_usec();
+	pthread_mutex_unlock(&throttle.lock);
+
+	vprintf(SDOG_INFO, "recovery rate %"PRIu32" MB/s%s\n", max_rate,
+		adaptive ? ", adaptive" : "");
+}
+
+/* Called when a gateway or peer request is done */
+void recovery_note_latency(uint64_t queued)
+{
+	uint64_t now, lat;
+
+	/* called for every request, don't take the lock for nothing */
+	if (!uatomic_read(&throttle.adaptive))
+		return;
+
+	now = monotonic_usec();
+	lat = now - queued;
+
+	pthread_mutex_lock(&throttle.lock);
+	/* exponentially weighted, 1/8 for the new sample */
+	throttle.latency = (throttle.latency * 7 + lat) / 8;
+	throttle.last_sample = now;
+	pthread_mutex_unlock(&throttle.lock);
+}
+
+/* Caller should hold throttle.lock */
+static void adjust_recovery_rate(uint64_t now)
+{
+	uint64_t latency = throttle.latency;
+
+	if (now - throttle.last_adjust < THROTTLE_ADJUST_INTERVAL)
+		return;
+	throttle.last_adjust = now;
+
+	if (now - throttle.last_sample > THROTTLE_LATENCY_STALE)
+		latency = 0;
+
+	if (latency > THROTTLE_LATENCY_TARGET)
+		throttle.rate = max(throttle.rate / 2,
+				    (uint64_t)THROTTLE_MIN_RATE);
+	else
+		throttle.rate = min(throttle.rate + throttle.max_rate / 10,
+				    throttle.max_rate);
+}
+
+/* Sleep until len bytes may be recovered without exceeding the limit */
+static void throttle_recovery(size_t len)
+{
+	uint64_t now, wait = 0;
+
+	pthread_mutex_lock(&throttle.lock);
+	if (!throttle.max_rate) {
+		pthread_mutex_unlock(&throttle.lock);
+		return;
+	}
+
+	now = monotonic_usec();
+	if (throttle.adaptive)
+		adjust_recovery_rate(now);
+
+	/* allow a burst of at most one second worth of data */
+	throttle.tokens += (now - throttle.last_refill) * throttle.rate / 1000000;
+	if (throttle.tokens > (int64_t)throttle.rate)
+		throttle.tokens = throttle.rate;
+	throttle.last_refill = now;
+
+	throttle.tokens -= len;
+	if (throttle.tokens < 0)
+		wait = -throttle.tokens * 1000000 / throttle.rate;
+	pthread_mutex_unlock(&throttle.lock);
+
+	if (wait)
+		usleep(wait);
+}
+
+/* Window over which the current recovery rate is measured */
+#define STAT_RATE_INTERVAL	(5 * 1000 * 1000) /* usec */
+
+/* Progress of the running recovery, for SD_OP_STAT_RECOVERY */
+static struct {
+	pthread_mutex_t lock;
+	struct recovery_stat cur;
+	uint64_t start;
+	uint64_t window_start;
+	uint64_t window_bytes;
+	uint64_t window_done;
+	uint64_t obj_rate; /* objects per second */
+
+	struct recovery_source_stat *sources;
+	int nr_sources;
+
+	struct recovery_history history[SD_RECOVERY_HISTORY];
+	int nr_history;
+} rstat = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Caller should hold rstat.lock */
+static void update_recovery_rate(uint64_t now)
+{
+	uint64_t elapsed = now - rstat.window_start;
+
+	if (elapsed < STAT_RATE_INTERVAL)
+		return;
+
+	rstat.cur.rate = (rstat.cur.bytes - rstat.window_bytes) * 1000000 /
+		elapsed;
+	rstat.obj_rate = (rstat.cur.nr_done - rstat.window_done) * 1000000 /
+		elapsed;
+	rstat.window_start = now;
+	rstat.window_bytes = rstat.cur.bytes;
+	rstat.window_done = rstat.cur.nr_done;
+}
+
+static void recovery_stat_start(struct recovery_work *rw)
+{
+	pthread_mutex_lock(&rstat.lock);
+	memset(&rstat.cur, 0, sizeof(rstat.cur));
+	rstat.cur.epoch = rw->epoch;
+	rstat.cur.preparing = 1;
+	rstat.start = rstat.window_start = monotonic_usec();
+	rstat.window_bytes = rstat.window_done = rstat.obj_rate = 0;
+	free(rstat.sources);
+	rstat.sources = NULL;
+	rstat.nr_sources = 0;
+	pthread_mutex_unlock(&rstat.lock);
+}
+
+static void recovery_stat_finish(int completed)
+{
+	struct recovery_history *h;
+
+	pthread_mutex_lock(&rstat.lock);
+	memmove(rstat.history + 1, rstat.history,
+		sizeof(*h) * (SD_RECOVERY_HISTORY - 1));
+	h = rstat.history;
+	h->epoch = rstat.cur.epoch;
+	h->completed = completed;
+	h->nr_done = rstat.cur.nr_done;
+	h->nr_failed = rstat.cur.nr_failed;
+	h->bytes = rstat.cur.bytes;
+	h->elapsed = (monotonic_usec() - rstat.start) / 1000000;
+	if (rstat.nr_history < SD_RECOVERY_HISTORY)
+		rstat.nr_history++;
+
+	rstat.cur.epoch = 0;
+	pthread_mutex_unlock(&rstat.lock);
+}
+
+/* Account bytes copied from the node nid, called by recovery workers */
+static void recovery_stat_copied(const struct node_id *nid, uint32_t bytes)
+{
+	struct recovery_source_stat *src;
+	int i;
+
+	pthread_mutex_lock(&rstat.lock);
+	for (i = 0; i < rstat.nr_sources; i++)
+		if (!memcmp(&rstat.sources[i].nid, nid, sizeof(*nid)))
+			break;
+	if (i == rstat.nr_sources) {
+		rstat.sources = xrealloc(rstat.sources,
+					 ++rstat.nr_sources * sizeof(*src));
+		memset(rstat.sources + i, 0, sizeof(*src));
+		rstat.sources[i].nid = *nid;
+	}
+	src = rstat.sources + i;
+	src->nr_objs++;
+	src->bytes += bytes;
+	rstat.cur.bytes += bytes;
+	update_recovery_rate(monotonic_usec());
+	pthread_mutex_unlock(&rstat.lock);
+}
+
+static void recovery_stat_done(int failed)
+{
+	pthread_mutex_lock(&rstat.lock);
+	rstat.cur.nr_done++;
+	if (failed)
+		rstat.cur.nr_failed++;
+	pthread_mutex_unlock(&rstat.lock);
+}
+
+/*
+ * Fill buf with a struct recovery_stat followed by the per-node and history
+ * entries, as many as fit in len bytes. Return the number of bytes used.
+ */
+int get_recovery_stat(void *buf, uint32_t len)
+{
+	struct recovery_stat *st = buf;
+	struct recovery_source_stat *src;
+	uint64_t now = monotonic_usec(), obj_rate;
+	uint32_t n;
+
+	if (len < sizeof(*st))
+		return -1;
+
+	pthread_mutex_lock(&rstat.lock);
+	update_recovery_rate(now);
+	*st = rstat.cur;
+	if (st->epoch) {
+		st->elapsed = (now - rstat.start) / 1000000;
+		/* until the first interval is over, use the average */
+		obj_rate = rstat.obj_rate;
+		if (!obj_rate && st->elapsed) {
+			st->rate = st->bytes / st->elapsed;
+			obj_rate = st->nr_done / st->elapsed;
+		}
+		if (!st->preparing && obj_rate)
+			st->eta = DIV_ROUND_UP(st->nr_total - st->nr_done,
+					       obj_rate);
+
+		n = min((uint32_t)rstat.nr_sources,
+			(uint32_t)((len - sizeof(*st)) / sizeof(*src)));
+		memcpy(st + 1, rstat.sources, n * sizeof(*src));
+		st->nr_sources = n;
+	}
+	src = (struct recovery_source_stat *)(st + 1) + st->nr_sources;
+	len -= (char *)src - (char *)buf;
+
+	n = min((uint32_t)rstat.nr_history,
+		(uint32_t)(len / sizeof(struct recovery_history)));
+	memcpy(src, rstat.history, n * sizeof(struct recovery_history));
+	st->nr_history = n;
+	pthread_mutex_unlock(&rstat.lock);
+
+	return (char *)src - (char *)buf +
+		n * sizeof(struct recovery_history);
+}
+
 static int obj_cmp(const void *oid1, const void *oid2)
 {
 	const uint64_t hval1 = fnv_64a_buf((void *)oid1, sizeof(uint64_t), FNV1A_64_INIT);
@@ -55,6 +350,86 @@ static int obj_cmp(const void *oid1, const void *oid2)
 	return 0;
 }
 
+/*
+ * Bring the copy we had before rejoining up to date by fetching only the
+ * blocks whose digests differ from the replica's. Return SD_RES_SUCCESS if buf
+ * holds the object afterwards, SD_RES_NETWORK_ERROR if the connection failed.
+ */
+static int resync_stale_object(int fd, uint64_t oid, char *buf, uint32_t len,
+			       uint32_t epoch, uint32_t tgt_epoch,
+			       uint32_t *fetched)
+{
+	int nr_blocks = DIV_ROUND_UP(len, SD_RESYNC_BLOCK_SIZE);
+	int i, ret, nr_fetched = 0;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	unsigned wlen, rlen;
+	uint8_t *local, *remote;
+	uint32_t off;
+
+	if (read_stale_object(oid, buf, len) != SD_RES_SUCCESS)
+		return SD_RES_NO_OBJ;
+
+	local = xmalloc(nr_blocks * SHA1_LEN);
+	remote = xmalloc(nr_blocks * SHA1_LEN);
+	get_block_digests(buf, len, local);
+
+	sd_init_req(&hdr, SD_OP_GET_OBJ_DIGEST);
+	hdr.epoch = epoch;
+	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	hdr.data_length = nr_blocks * SHA1_LEN;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = tgt_epoch;
+
+	wlen = 0;
+	rlen = hdr.data_length;
+	if (exec_req(fd, &hdr, remote, &wlen, &rlen)) {
+		ret = SD_RES_NETWORK_ERROR;
+		goto out;
+	}
+	if (rsp->result != SD_RES_SUCCESS ||
+	    rsp->data_length != nr_blocks * SHA1_LEN) {
+		ret = rsp->result ? rsp->result : SD_RES_EIO;
+		goto out;
+	}
+
+	for (i = 0; i < nr_blocks; i++) {
+		if (!memcmp(local + i * SHA1_LEN, remote + i * SHA1_LEN,
+			    SHA1_LEN))
+			continue;
+
+		off = i * SD_RESYNC_BLOCK_SIZE;
+		sd_init_req(&hdr, SD_OP_READ_PEER);
+		hdr.epoch = epoch;
+		hdr.flags = SD_FLAG_CMD_RECOVERY;
+		hdr.data_length = min(len - off, (uint32_t)SD_RESYNC_BLOCK_SIZE);
+		hdr.obj.oid = oid;
+		hdr.obj.offset = off;
+		hdr.obj.tgt_epoch = tgt_epoch;
+
+		wlen = 0;
+		rlen = hdr.data_length;
+		if (exec_req(fd, &hdr, buf + off, &wlen, &rlen)) {
+			ret = SD_RES_NETWORK_ERROR;
+			goto out;
+		}
+		if (rsp->result != SD_RES_SUCCESS) {
+			ret = rsp->result;
+			goto out;
+		}
+		nr_fetched++;
+		*fetched += hdr.data_length;
+	}
+
+	dprintf("%"PRIx64": %d of %d blocks fetched\n", oid, nr_fetched,
+		nr_blocks);
+	ret = SD_RES_SUCCESS;
+out:
+	free(local);
+	free(remote);
+	return ret;
+}
+
 static int recover_object_from_replica(uint64_t oid,
 				       struct sd_vnode *entry,
 				       uint32_t epoch, uint32_t tgt_epoch)
@@ -63,9 +438,11 @@ static int recover_object_from_replica(uint64_t oid,
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	char name[128];
 	unsigned wlen = 0, rlen;
-	int fd, ret = -1;
+	int ret = -1;
 	void *buf;
 	struct siocb iocb = { 0 };
+	struct sockfd *sfd;
+	uint32_t fetched = 0;
 
 	rlen = get_objsize(oid);
 
@@ -89,14 +466,25 @@ static int recover_object_from_replica(uint64_t oid,
 	}
 
 	addr_to_str(name, sizeof(name), entry->nid.addr, 0);
-	fd = connect_to(name, entry->nid.port);
+	sfd = sheep_get_sockfd(&entry->nid);
 	dprintf("%s, %d\n", name, entry->nid.port);
-	if (fd < 0) {
+	if (!sfd) {
 		eprintf("failed to connect to %s:%"PRIu32"\n", name, entry->nid.port);
 		ret = -1;
 		goto out;
 	}
 
+	ret = resync_stale_object(sfd->fd, oid, buf, rlen, epoch, tgt_epoch,
+				  &fetched);
+	if (ret == SD_RES_SUCCESS) {
+		sheep_put_sockfd(&entry->nid, sfd);
+		goto put;
+	} else if (ret == SD_RES_NETWORK_ERROR) {
+		sheep_del_sockfd(&entry->nid, sfd);
+		ret = -1;
+		goto out;
+	}
+
 	sd_init_req(&hdr, SD_OP_READ_PEER);
 	hdr.epoch = epoch;
 	hdr.flags = SD_FLAG_CMD_RECOVERY;
@@ -105,32 +493,34 @@ static int recover_object_from_replica(uint64_t oid,
 	hdr.obj.oid = oid;
 	hdr.obj.tgt_epoch = tgt_epoch;
 
-	ret = exec_req(fd, &hdr, buf, &wlen, &rlen);
-
-	close(fd);
-
+	ret = exec_req(sfd->fd, &hdr, buf, &wlen, &rlen);
 	if (ret != 0) {
+		sheep_del_sockfd(&entry->nid, sfd);
 		eprintf("res: %"PRIx32"\n", rsp->result);
 		ret = -1;
 		goto out;
 	}
+	sheep_put_sockfd(&entry->nid, sfd);
 
 	rsp = (struct sd_rsp *)&hdr;
 
-	if (rsp->result == SD_RES_SUCCESS) {
-		iocb.epoch = epoch;
-		iocb.length = rlen;
-		iocb.buf = buf;
-		ret = sd_store->atomic_put(oid, &iocb);
-		if (ret != SD_RES_SUCCESS) {
-			ret = -1;
-			goto out;
-		}
-	} else {
+	if (rsp->result != SD_RES_SUCCESS) {
 		eprintf("failed, res: %"PRIx32"\n", rsp->result);
 		ret = rsp->result;
 		goto out;
 	}
+	fetched = rlen;
+put:
+	iocb.epoch = epoch;
+	iocb.length = rlen;
+	iocb.buf = buf;
+	ret = sd_store->atomic_put(oid, &iocb);
+	if (ret != SD_RES_SUCCESS) {
+		ret = -1;
+		goto out;
+	}
+	remove_stale_object(oid);
+	recovery_stat_copied(&entry->nid, fetched);
 done:
 	dprintf("recovered oid %"PRIx64" from %d to epoch %d\n", oid, tgt_epoch, epoch);
 out:
@@ -158,12 +548,11 @@ static int is_invalid_vnode(struct sd_vnode *entry, struct sd_node *nodes,
  * the routine will try to recovery it from the nodes it has stayed,
  * at least, *theoretically* on consistent hash ring.
  */
-static int do_recover_object(struct recovery_work *rw)
+static int do_recover_object(struct recovery_work *rw, uint64_t oid)
 {
 	struct vnode_info *old;
-	uint64_t oid = rw->oids[rw->done];
 	uint32_t epoch = rw->epoch, tgt_epoch = rw->epoch - 1;
-	int nr_copies, ret, i;
+	int nr_copies, ret, i, start = random();
 
 	old = grab_vnode_info(rw->old_vnodes);
 
@@ -171,12 +560,17 @@ again:
 	dprintf("try recover object %"PRIx64" from epoch %"PRIu32"\n",
 		oid, tgt_epoch);
 
-	/* Let's do a breadth-first search */
+	/*
+	 * Let's do a breadth-first search, starting at a random copy so that
+	 * objects recovered in parallel are pulled from different nodes
+	 */
 	nr_copies = get_nr_copies(old);
 	for (i = 0; i < nr_copies; i++) {
-		struct sd_vnode *tgt_vnode = oid_to_vnode(old, oid, i);
+		int idx = (i + start) % nr_copies;
+		struct sd_vnode *tgt_vnode = oid_to_vnode(old, oid, idx);
 
-		if (is_invalid_vnode(tgt_vnode, rw->cur_vnodes->nodes,
+		if (!tgt_vnode ||
+		    is_invalid_vnode(tgt_vnode, rw->cur_vnodes->nodes,
 				     rw->cur_vnodes->nr_nodes))
 			continue;
 		ret = recover_object_from_replica(oid, tgt_vnode,
@@ -217,11 +611,94 @@ err:
 	return ret;
 }
 
+/*
+ * Return the vnode info of the epoch the running recovery copies objects
+ * from, so that reads of objects not recovered yet can be served from there.
+ * Returns NULL if the read has to wait for recovery instead.
+ */
+struct vnode_info *get_recovery_source(uint32_t *epoch)
+{
+	struct recovery_work *rw = recovering_work;
+
+	if (!rw || rw->stop || next_rw || before(rw->epoch, sys->epoch))
+		return NULL;
+
+	*epoch = rw->epoch;
+	return grab_vnode_info(rw->old_vnodes);
+}
+
+/*
+ * Read a range of an object that is not recovered yet from one of its copies
+ * in the epoch before 'epoch', the same copies recovery pulls it from
+ */
+int read_object_from_source(struct vnode_info *old, struct vnode_info *cur,
+			    uint32_t epoch, uint64_t oid, char *buf,
+			    uint32_t len, uint64_t offset)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct siocb iocb = { 0 };
+	struct sd_vnode *v;
+	struct sockfd *sfd;
+	unsigned wlen, rlen;
+	int nr_copies, i, ret = SD_RES_NO_OBJ, start = random();
+
+	nr_copies = get_nr_copies(old);
+	for (i = 0; i < nr_copies; i++) {
+		v = oid_to_vnode(old, oid, (i + start) % nr_copies);
+		if (!v || is_invalid_vnode(v, cur->nodes, cur->nr_nodes))
+			continue;
+
+		if (vnode_is_local(v)) {
+			iocb.epoch = epoch - 1;
+			iocb.buf = buf;
+			iocb.length = len;
+			iocb.offset = offset;
+			ret = sd_store->read(oid, &iocb);
+			if (ret == SD_RES_SUCCESS)
+				break;
+			continue;
+		}
+
+		sfd = sheep_get_sockfd(&v->nid);
+		if (!sfd) {
+			ret = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+
+		sd_init_req(&hdr, SD_OP_READ_PEER);
+		hdr.epoch = epoch;
+		hdr.flags = SD_FLAG_CMD_RECOVERY;
+		hdr.data_length = len;
+		hdr.obj.oid = oid;
+		hdr.obj.offset = offset;
+		hdr.obj.tgt_epoch = epoch - 1;
+
+		wlen = 0;
+		rlen = len;
+		if (exec_req(sfd->fd, &hdr, buf, &wlen, &rlen)) {
+			sheep_del_sockfd(&v->nid, sfd);
+			ret = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+		sheep_put_sockfd(&v->nid, sfd);
+
+		ret = rsp->result;
+		if (ret == SD_RES_SUCCESS)
+			break;
+	}
+
+	dprintf("%"PRIx64" from epoch %"PRIu32", %x\n", oid, epoch - 1, ret);
+	return ret;
+}
+
 static void recover_object_work(struct work *work)
 {
-	struct recovery_work *rw = container_of(work, struct recovery_work,
-						work);
-	uint64_t oid = rw->oids[rw->done];
+	struct recovery_obj_work *ow = container_of(work,
+						    struct recovery_obj_work,
+						    work);
+	struct recovery_work *rw = ow->rw;
+	uint64_t oid = ow->oid;
 	int ret;
 
 	eprintf("done:%"PRIu32" count:%"PRIu32", oid:%"PRIx64"\n",
@@ -232,9 +709,13 @@ static void recover_object_work(struct work *work)
 		return;
 	}
 
-	ret = do_recover_object(rw);
-	if (ret < 0)
+	throttle_recovery(get_objsize(oid));
+
+	ret = do_recover_object(rw, oid);
+	if (ret < 0) {
 		eprintf("failed to recover object %"PRIx64"\n", oid);
+		ow->failed = 1;
+	}
 }
 
 int node_in_recovery(void)
@@ -258,18 +739,14 @@ static inline void prepare_schedule_oid(uint64_t oid)
 		if (rw->prio_oids[i] == oid )
 			return;
 	/*
-	 * We need this check because oid might not be recovered.
+	 * The oid is either being recovered now or might not be recovered.
 	 * Very much unlikely though, but it might happen indeed.
 	 */
 	for (i = 0; i < rw->done; i++)
 		if (rw->oids[i] == oid) {
-			dprintf("%"PRIx64" not recovered, don't schedule it\n",
-				oid);
+			dprintf("%"PRIx64" already scheduled\n", oid);
 			return;
 		}
-	/* The oid is currently being recovered */
-	if (rw->oids[rw->done] == oid)
-		return;
 	rw->nr_prio_oids++;
 	rw->prio_oids = xrealloc(rw->prio_oids,
 				 rw->nr_prio_oids * sizeof(uint64_t));
@@ -278,6 +755,16 @@ static inline void prepare_schedule_oid(uint64_t oid)
 	dprintf("%"PRIx64" nr_prio_oids %d\n", oid, rw->nr_prio_oids);
 }
 
+static bool oid_in_flight(struct recovery_work *rw, uint64_t oid)
+{
+	int i;
+
+	for (i = 0; i < rw->nr_inflight; i++)
+		if (rw->inflight[i] == oid)
+			return true;
+	return false;
+}
+
 bool oid_in_recovery(uint64_t oid)
 {
 	struct recovery_work *rw = recovering_work;
@@ -298,8 +785,11 @@ bool oid_in_recovery(uint64_t oid)
 	if (rw->state == RW_INIT)
 		return true;
 
+	if (oid_in_flight(rw, oid))
+		return true;
+
 	/* FIXME: do we need more efficient yet complex data structure? */
-	for (i = rw->done - 1; i < rw->count; i++)
+	for (i = rw->done; i < rw->count; i++)
 		if (rw->oids[i] == oid)
 			break;
 
@@ -324,14 +814,18 @@ static void free_recovery_work(struct recovery_work *rw)
 	free(rw);
 }
 
+static void queue_object_list_works(struct recovery_work *rw);
+
 static inline void run_next_rw(struct recovery_work *rw)
 {
 	free_recovery_work(rw);
+	recovery_stat_finish(0);
 	rw = next_rw;
 	next_rw = NULL;
 	recovering_work = rw;
+	recovery_stat_start(rw);
 	flush_wait_obj_requests();
-	queue_work(sys->recovery_wqueue, &rw->work);
+	queue_object_list_works(rw);
 	dprintf("recovery work is superseded\n");
 }
 
@@ -343,6 +837,9 @@ static inline void finish_recovery(struct recovery_work *rw)
 	if (sd_store->end_recover)
 		sd_store->end_recover(sys->epoch - 1, rw->old_vnodes);
 
+	purge_stale_objects();
+	recovery_stat_finish(1);
+
 	free_recovery_work(rw);
 
 	dprintf("recovery complete: new epoch %"PRIu32"\n",
@@ -376,7 +873,7 @@ static inline void finish_schedule_oids(struct recovery_work *rw)
 	if (nr_recovered == rw->count - 1)
 		goto done;
 
-	new_oids = xmalloc(1 << 20); /* FIXME */
+	new_oids = xmalloc(rw->count * sizeof(uint64_t));
 	memcpy(new_oids, rw->oids, nr_recovered * sizeof(uint64_t));
 	memcpy(new_oids + nr_recovered, rw->prio_oids,
 	       rw->nr_prio_oids * sizeof(uint64_t));
@@ -400,16 +897,55 @@ done:
 	rw->nr_prio_oids = 0;
 }
 
-static void recover_object_main(struct work *work)
+static void recover_object_main(struct work *work);
+
+/* Fill the recovery window up, called in the main thread */
+static void recover_next_objects(struct recovery_work *rw)
 {
-	struct recovery_work *rw = container_of(work, struct recovery_work,
-						work);
-	if (next_rw) {
-		run_next_rw(rw);
-		return;
+	struct recovery_obj_work *ow;
+	int window = min(sys->recovery_window, SD_MAX_RECOVERY_WINDOW);
+
+	while (rw->done < rw->count && rw->nr_inflight < window) {
+		if (rw->nr_prio_oids)
+			finish_schedule_oids(rw);
+
+		ow = xzalloc(sizeof(*ow));
+		ow->rw = rw;
+		ow->oid = rw->oids[rw->done++];
+		ow->work.fn = recover_object_work;
+		ow->work.done = recover_object_main;
+
+		rw->inflight[rw->nr_inflight++] = ow->oid;
+		queue_work(sys->recovery_wqueue, &ow->work);
 	}
+}
+
+static void recover_object_main(struct work *work)
+{
+	struct recovery_obj_work *ow = container_of(work,
+						    struct recovery_obj_work,
+						    work);
+	struct recovery_work *rw = ow->rw;
+	uint64_t oid = ow->oid;
+	int i;
+
+	recovery_stat_done(ow->failed);
+	free(ow);
+	for (i = 0; i < rw->nr_inflight; i++)
+		if (rw->inflight[i] == oid) {
+			rw->inflight[i] = rw->inflight[--rw->nr_inflight];
+			break;
+		}
+
+	if (next_rw || rw->stop) {
+		/* Wait for the other objects in flight before leaving */
+		if (rw->nr_inflight)
+			return;
 
-	if (rw->stop){
+		if (next_rw) {
+			run_next_rw(rw);
+			return;
+		}
 		/*
 		 * Stop this recovery process and wait for epoch to be
 		 * lifted and flush wait_obj queue to requeue those
@@ -420,18 +956,16 @@ static void recover_object_main(struct work *work)
 		return;
 	}
 
-	resume_wait_obj_requests(rw->oids[rw->done++]);
+	resume_wait_obj_requests(oid);
 
 	if (rw->done < rw->count) {
-		if (rw->nr_prio_oids)
-			finish_schedule_oids(rw);
-
-		/* Try recover next object */
-		queue_work(sys->recovery_wqueue, &rw->work);
+		/* Try recover next objects */
+		recover_next_objects(rw);
 		return;
 	}
 
-	finish_recovery(rw);
+	if (!rw->nr_inflight)
+		finish_recovery(rw);
 }
 
 static void finish_object_list(struct work *work)
@@ -443,6 +977,12 @@ static void finish_object_list(struct work *work)
 		run_next_rw(rw);
 		return;
 	}
+
+	pthread_mutex_lock(&rstat.lock);
+	rstat.cur.preparing = 0;
+	rstat.cur.nr_total = rw->count;
+	pthread_mutex_unlock(&rstat.lock);
+
 	if (!rw->count) {
 		finish_recovery(rw);
 		return;
@@ -454,81 +994,94 @@ static void finish_object_list(struct work *work)
 	 * without any problem.
 	 */
 	resume_wait_recovery_requests();
-	rw->work.fn = recover_object_work;
-	rw->work.done = recover_object_main;
-	queue_work(sys->recovery_wqueue, &rw->work);
-	return;
+	recover_next_objects(rw);
 }
 
-/* Fetch the object list from all the nodes in the cluster */
+/*
+ * Fetch the object list of the node page by page and return the number of
+ * oids read into *oids, or -1 on error
+ */
 static int fetch_object_list(struct sd_node *e, uint32_t epoch,
-			     uint8_t *buf, size_t buf_size)
+			     uint64_t **oids)
 {
-	int fd, ret;
+	int ret, count = 0;
 	unsigned wlen, rlen;
 	char name[128];
+	struct sockfd *sfd;
 	struct sd_list_req hdr;
-	struct sd_list_rsp *rsp;
+	struct sd_list_rsp *rsp = (struct sd_list_rsp *)&hdr;
+	uint64_t cursor = 0;
+	uint64_t *buf = NULL;
 
 	addr_to_str(name, sizeof(name), e->nid.addr, 0);
 
 	dprintf("%s %"PRIu32"\n", name, e->nid.port);
 
-	fd = connect_to(name, e->nid.port);
-	if (fd < 0) {
+	sfd = sheep_get_sockfd(&e->nid);
+	if (!sfd) {
 		eprintf("%s %"PRIu32"\n", name, e->nid.port);
 		return -1;
 	}
 
-	wlen = 0;
-	rlen = buf_size;
-
-	sd_init_req((struct sd_req *)&hdr, SD_OP_GET_OBJ_LIST);
-	hdr.tgt_epoch = epoch - 1;
-	hdr.flags = 0;
-	hdr.data_length = rlen;
-
-	ret = exec_req(fd, (struct sd_req *)&hdr, buf, &wlen, &rlen);
-
-	close(fd);
+	do {
+		buf = xrealloc(buf, count * sizeof(uint64_t) + OBJ_LIST_CHUNK);
+
+		wlen = 0;
+		rlen = OBJ_LIST_CHUNK;
+
+		sd_init_req((struct sd_req *)&hdr, SD_OP_GET_OBJ_LIST);
+		hdr.tgt_epoch = epoch - 1;
+		hdr.flags = SD_FLAG_CMD_PAGED;
+		hdr.data_length = rlen;
+		hdr.cursor = cursor;
+
+		ret = exec_req(sfd->fd, (struct sd_req *)&hdr, buf + count,
+			       &wlen, &rlen);
+		if (ret || rsp->result != SD_RES_SUCCESS) {
+			eprintf("failed, %"PRIu32", %"PRIu32"\n", ret,
+				rsp->result);
+			if (ret)
+				sheep_del_sockfd(&e->nid, sfd);
+			else
+				sheep_put_sockfd(&e->nid, sfd);
+			free(buf);
+			return -1;
+		}
 
-	rsp = (struct sd_list_rsp *)&hdr;
+		count += rsp->data_length / sizeof(uint64_t);
+		cursor = rsp->next_cursor;
+	} while (rsp->more);
 
-	if (ret || rsp->result != SD_RES_SUCCESS) {
-		eprintf("failed, %"PRIu32", %"PRIu32"\n", ret, rsp->result);
-		return -1;
-	}
+	sheep_put_sockfd(&e->nid, sfd);
 
-	dprintf("%"PRIu64"\n", rsp->data_length / sizeof(uint64_t));
+	dprintf("%d\n", count);
 
-	return rsp->data_length / sizeof(uint64_t);
+	*oids = buf;
+	return count;
 }
 
 /* Screen out objects that don't belong to this node */
-static void screen_object_list(struct recovery_work *rw,
-			       uint64_t *oids, int nr_oids)
+static int screen_object_list(struct recovery_work *rw,
+			      uint64_t *oids, int nr_oids)
 {
 	struct sd_vnode *vnodes[SD_MAX_COPIES];
-	int old_count = rw->count;
-	int nr_objs;
+	int nr_objs, nr_found, count = 0;
 	int i, j;
 
 	nr_objs = get_nr_copies(rw->cur_vnodes);
 	for (i = 0; i < nr_oids; i++) {
-		oid_to_vnodes(rw->cur_vnodes, oids[i], nr_objs, vnodes);
-		for (j = 0; j < nr_objs; j++) {
+		nr_found = oid_to_vnodes(rw->cur_vnodes, oids[i], nr_objs,
+					 vnodes);
+		for (j = 0; j < nr_found; j++) {
 			if (!vnode_is_local(vnodes[j]))
 				continue;
-			if (bsearch(&oids[i], rw->oids, old_count,
-				    sizeof(uint64_t), obj_cmp))
-				continue;
 
-			rw->oids[rw->count++] = oids[i];
+			oids[count++] = oids[i];
 			break;
 		}
 	}
 
-	qsort(rw->oids, rw->count, sizeof(uint64_t), obj_cmp);
+	return count;
 }
 
 static int newly_joined(struct sd_node *node, struct recovery_work *rw)
@@ -539,49 +1092,102 @@ static int newly_joined(struct sd_node *node, struct recovery_work *rw)
 	return 1;
 }
 
-/* Prepare the object list that belongs to this node */
+static void fetch_object_list_work(struct work *work)
+{
+	struct object_list_work *lw = container_of(work,
+						   struct object_list_work,
+						   work);
+	struct recovery_work *rw = lw->rw;
+	int nr;
+
+	if (next_rw)
+		return;
+
+	nr = fetch_object_list(lw->node, rw->epoch, &lw->oids);
+	if (nr < 0)
+		return;
+	lw->count = screen_object_list(rw, lw->oids, nr);
+}
+
+/* Sort the merged object list and drop the duplicates */
 static void prepare_object_list(struct work *work)
 {
 	struct recovery_work *rw = container_of(work, struct recovery_work,
 						work);
-	uint8_t *buf = NULL;
-	size_t buf_size = SD_DATA_OBJ_SIZE; /* FIXME */
+	int i, count = 0;
+
+	if (next_rw) {
+		dprintf("go to the next recovery\n");
+		return;
+	}
+
+	qsort(rw->oids, rw->count, sizeof(uint64_t), obj_cmp);
+	for (i = 0; i < rw->count; i++) {
+		if (count && rw->oids[count - 1] == rw->oids[i])
+			continue;
+		rw->oids[count++] = rw->oids[i];
+	}
+	rw->count = count;
+
+	dprintf("%d\n", rw->count);
+}
+
+static void fetch_object_list_done(struct work *work)
+{
+	struct object_list_work *lw = container_of(work,
+						   struct object_list_work,
+						   work);
+	struct recovery_work *rw = lw->rw;
+
+	if (lw->count) {
+		rw->oids = xrealloc(rw->oids, (rw->count + lw->count) *
+				    sizeof(uint64_t));
+		memcpy(rw->oids + rw->count, lw->oids,
+		       lw->count * sizeof(uint64_t));
+		rw->count += lw->count;
+	}
+	free(lw->oids);
+	free(lw);
+
+	rw->nr_fetching--;
+	queue_object_list_works(rw);
+}
+
+/*
+ * Keep up to OBJ_LIST_PARALLEL object list fetches running, and once all the
+ * lists are in, build the list of objects to recover. Called in the main
+ * thread.
+ */
+static void queue_object_list_works(struct recovery_work *rw)
+{
 	struct sd_node *cur = rw->cur_vnodes->nodes;
 	int cur_nr = rw->cur_vnodes->nr_nodes;
-	int start = random() % cur_nr, i, end = cur_nr;
+	struct object_list_work *lw;
 
-	dprintf("%u\n", rw->epoch);
-
-	buf = xmalloc(buf_size);
-again:
-	/* We need to start at random node for better load balance */
-	for (i = start; i < end; i++) {
-		int buf_nr;
-		struct sd_node *node = cur + i;
+	while (!next_rw && rw->next_node < cur_nr &&
+	       rw->nr_fetching < OBJ_LIST_PARALLEL) {
+		struct sd_node *node = cur + rw->next_node++;
 
-		if (next_rw) {
-			dprintf("go to the next recovery\n");
-			goto out;
-		}
 		if (newly_joined(node, rw))
 			/* new node doesn't have a list file */
 			continue;
 
-		buf_nr = fetch_object_list(node, rw->epoch, buf, buf_size);
-		if (buf_nr < 0)
-			continue;
-		screen_object_list(rw, (uint64_t *)buf, buf_nr);
-	}
+		lw = xzalloc(sizeof(*lw));
+		lw->rw = rw;
+		lw->node = node;
+		lw->work.fn = fetch_object_list_work;
+		lw->work.done = fetch_object_list_done;
 
-	if (start != 0) {
-		end = start;
-		start = 0;
-		goto again;
+		rw->nr_fetching++;
+		queue_work(sys->recovery_wqueue, &lw->work);
 	}
 
-	dprintf("%d\n", rw->count);
-out:
-	free(buf);
+	if (rw->nr_fetching)
+		return;
+
+	rw->work.fn = prepare_object_list;
+	rw->work.done = finish_object_list;
+	queue_work(sys->recovery_wqueue, &rw->work);
 }
 
 int start_recovery(struct vnode_info *cur_vnodes, struct vnode_info *old_vnodes)
@@ -595,16 +1201,12 @@ int start_recovery(struct vnode_info *cur_vnodes, struct vnode_info *old_vnodes)
 	}
 
 	rw->state = RW_INIT;
-	rw->oids = xmalloc(1 << 20); /* FIXME */
 	rw->epoch = sys->epoch;
 	rw->count = 0;
 
 	rw->cur_vnodes = grab_vnode_info(cur_vnodes);
 	rw->old_vnodes = grab_vnode_info(old_vnodes);
 
-	rw->work.fn = prepare_object_list;
-	rw->work.done = finish_object_list;
-
 	if (sd_store->begin_recover) {
 		struct siocb iocb = { 0 };
 		iocb.epoch = rw->epoch;
@@ -619,7 +1221,8 @@ int start_recovery(struct vnode_info *cur_vnodes, struct vnode_info *old_vnodes)
 		next_rw = rw;
 	} else {
 		recovering_work = rw;
-		queue_work(sys->recovery_wqueue, &rw->work);
+		recovery_stat_start(rw);
+		queue_object_list_works(rw);
 	}
 
 	resume_wait_epoch_requests();
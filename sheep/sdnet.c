@@ -31,7 +31,7 @@ static int is_access_local(struct request *req, uint64_t oid)
 	int i;
 
 	nr_copies = get_nr_copies(req->vnodes);
-	oid_to_vnodes(req->vnodes, oid, nr_copies, obj_vnodes);
+	nr_copies = oid_to_vnodes(req->vnodes, oid, nr_copies, obj_vnodes);
 
 	for (i = 0; i < nr_copies; i++) {
 		if (vnode_is_local(obj_vnodes[i]))
@@ -45,6 +45,9 @@ static void io_op_done(struct work *work)
 {
 	struct request *req = container_of(work, struct request, work);
 
+	if (req->queued)
+		recovery_note_latency(req->queued);
+
 	if (req->rp.result == SD_RES_EIO) {
 		req->rp.result = SD_RES_NETWORK_ERROR;
 
@@ -61,6 +64,9 @@ static void gateway_op_done(struct work *work)
 	struct request *req = container_of(work, struct request, work);
 	struct sd_req *hdr = &req->rq;
 
+	if (req->queued)
+		recovery_note_latency(req->queued);
+
 	switch (req->rp.result) {
 	case SD_RES_OLD_NODE_VER:
 		if (req->rp.epoch > sys->epoch) {
@@ -131,6 +137,90 @@ static int check_request_epoch(struct request *req)
 	return 0;
 }
 
+/* Put request on wait queues of local node */
+static void wait_for_recovery(struct request *req)
+{
+	if (is_recovery_init()) {
+		req->rp.result = SD_RES_OBJ_RECOVERING;
+		list_add_tail(&req->request_list, &sys->wait_rw_queue);
+	} else
+		list_add_tail(&req->request_list, &sys->wait_obj_queue);
+}
+
+struct proxy_read_work {
+	struct request *req;
+	struct vnode_info *old_vnodes;
+	uint32_t epoch;
+	struct work work;
+};
+
+static void do_proxy_read(struct work *work)
+{
+	struct proxy_read_work *pw = container_of(work, struct proxy_read_work,
+						  work);
+	struct request *req = pw->req;
+	struct sd_req *hdr = &req->rq;
+	int ret;
+
+	ret = read_object_from_source(pw->old_vnodes, req->vnodes, pw->epoch,
+				      hdr->obj.oid, req->data,
+				      hdr->data_length, hdr->obj.offset);
+	if (ret == SD_RES_SUCCESS) {
+		req->rp.data_length = hdr->data_length;
+		req->rp.obj.copies = sys->nr_copies;
+	}
+	req->rp.result = ret;
+}
+
+static void proxy_read_done(struct work *work)
+{
+	struct proxy_read_work *pw = container_of(work, struct proxy_read_work,
+						  work);
+	struct request *req = pw->req;
+
+	put_vnode_info(pw->old_vnodes);
+	free(pw);
+
+	if (req->rp.result == SD_RES_SUCCESS) {
+		put_request(req);
+		return;
+	}
+
+	/* fall back to the recovered copy */
+	if (oid_in_recovery(req->local_oid))
+		wait_for_recovery(req);
+	else
+		requeue_request(req);
+}
+
+/*
+ * A read needn't wait for recovery: serve it from the copy recovery is going
+ * to pull the object from.
+ */
+static bool proxy_read(struct request *req)
+{
+	struct proxy_read_work *pw;
+	struct vnode_info *old;
+	uint32_t epoch;
+
+	if (req->rq.opcode != SD_OP_READ_OBJ &&
+	    req->rq.opcode != SD_OP_READ_PEER)
+		return false;
+
+	old = get_recovery_source(&epoch);
+	if (!old)
+		return false;
+
+	pw = xzalloc(sizeof(*pw));
+	pw->req = req;
+	pw->old_vnodes = old;
+	pw->epoch = epoch;
+	pw->work.fn = do_proxy_read;
+	pw->work.done = proxy_read_done;
+	queue_work(sys->gateway_wqueue, &pw->work);
+	return true;
+}
+
 static bool request_in_recovery(struct request *req)
 {
 	/*
@@ -140,17 +230,8 @@ static bool request_in_recovery(struct request *req)
 	 */
 	if (oid_in_recovery(req->local_oid) &&
 	    !(req->rq.flags & SD_FLAG_CMD_RECOVERY)) {
-		/*
-		 * Put request on wait queues of local node
-		 */
-		if (is_recovery_init()) {
-			req->rp.result = SD_RES_OBJ_RECOVERING;
-			list_add_tail(&req->request_list,
-				      &sys->wait_rw_queue);
-		} else {
-			list_add_tail(&req->request_list,
-				      &sys->wait_obj_queue);
-		}
+		if (!proxy_read(req))
+			wait_for_recovery(req);
 		return true;
 	}
 	return false;
@@ -253,6 +334,8 @@ static void queue_peer_request(struct request *req)
 
 	if (req->rq.flags & SD_FLAG_CMD_RECOVERY)
 		req->rq.epoch = req->rq.obj.tgt_epoch;
+	else
+		req->queued = monotonic_usec();
 
 	req->work.fn = do_process_work;
 	req->work.done = io_op_done;
@@ -279,6 +362,7 @@ static void queue_gateway_request(struct request *req)
 			return;
 
 queue_work:
+	req->queued = monotonic_usec();
 	req->work.fn = do_process_work;
 	req->work.done = gateway_op_done;
 	queue_work(sys->gateway_wqueue, &req->work);
@@ -38,16 +38,19 @@ static struct option const long_options[] = {
 	{"gateway", no_argument, NULL, 'g'},
 	{"help", no_argument, NULL, 'h'},
 	{"loglevel", required_argument, NULL, 'l'},
+	{"memcache", required_argument, NULL, 'm'},
 	{"myaddr", required_argument, NULL, 'y'},
 	{"stdout", no_argument, NULL, 'o'},
 	{"port", required_argument, NULL, 'p'},
+	{"recovery-window", required_argument, NULL, 'r'},
+	{"snapcache", required_argument, NULL, 's'},
 	{"vnodes", required_argument, NULL, 'v'},
 	{"enable-cache", no_argument, NULL, 'w'},
 	{"zone", required_argument, NULL, 'z'},
 	{NULL, 0, NULL, 0},
 };
 
-static const char *short_options = "c:dDfghl:op:v:wy:z:";
+static const char *short_options = "c:dDfghl:m:op:r:s:v:wy:z:";
 
 static void usage(int status)
 {
@@ -66,9 +69,12 @@ Options:\n\
   -g, --gateway           make the progam run as a gateway mode (same as '-v 0')\n\
   -h, --help              display this help and exit\n\
   -l, --loglevel          specify the level of logging detail\n\
+  -m, --memcache          specify the memory (MB) kept in front of object cache\n\
   -o, --stdout            log to stdout instead of shared logger\n\
   -p, --port              specify the TCP port on which to listen\n\
-  -v, --vnodes            specify the number of virtual nodes\n\
+  -r, --recovery-window   specify the number of objects recovered in parallel\n\
+  -s, --snapcache         specify the memory (MB) to cache snapshot objects\n\
+  -v, --vnodes            specify the number of virtual nodes, or 'auto'\n\
   -w, --enable-cache      enable object cache\n\
   -y, --myaddr            specify the address advertised to other sheep\n\
   -z, --zone              specify the zone id\n\
@@ -91,6 +97,32 @@ Available log levels:\n\
   7    SDOG_DEBUG      debugging messages\n");
 }
 
+/*
+ * Scale the default number of virtual nodes by the store size relative to
+ * SD_VNODE_REF_CAPACITY, so that nodes with bigger disks receive a
+ * proportionally bigger share of objects. The minimum keeps small nodes
+ * from ending up with too few vnodes to be spread evenly over the ring.
+ */
+static int capacity_to_vnodes(void)
+{
+	uint64_t size, free_size, nr;
+	int ret;
+
+	ret = stat_sheep(&size, &free_size, 0);
+	if (ret != SD_RES_SUCCESS) {
+		eprintf("failed to get the store size, %s\n", sd_strerror(ret));
+		return -1;
+	}
+
+	nr = DIV_ROUND_UP(size * SD_DEFAULT_VNODES, SD_VNODE_REF_CAPACITY);
+	nr = max(nr, (uint64_t)SD_MIN_AUTO_VNODES);
+	nr = min(nr, (uint64_t)UINT16_MAX);
+	vprintf(SDOG_INFO, "%" PRIu64 " virtual nodes for %" PRIu64 " GB\n",
+		nr, size >> 30);
+
+	return nr;
+}
+
 static struct cluster_info __sys;
 struct cluster_info *sys = &__sys;
 
@@ -110,9 +142,12 @@ int main(int argc, char **argv)
 	char *p;
 	struct cluster_driver *cdrv;
 	int enable_write_cache = 0; /* disabled by default */
+	uint64_t memcache_size, snapcache_size = 0;
 
 	signal(SIGPIPE, SIG_IGN);
 
+	sys->recovery_window = SD_DEFAULT_RECOVERY_WINDOW;
+
 	while ((ch = getopt_long(argc, argv, short_options, long_options,
 				 &longindex)) >= 0) {
 		switch (ch) {
@@ -173,11 +208,43 @@ int main(int argc, char **argv)
 			}
 			sys->this_node.zone = zone;
 			break;
+		case 'm':
+			memcache_size = strtoull(optarg, &p, 10);
+			if (optarg == p || memcache_size > UINT32_MAX) {
+				fprintf(stderr, "Invalid memory cache size '%s'\n",
+					optarg);
+				exit(1);
+			}
+			sys->memcache_size = memcache_size * 1024 * 1024;
+			break;
+		case 'r':
+			sys->recovery_window = strtol(optarg, &p, 10);
+			if (optarg == p || sys->recovery_window < 1 ||
+			    sys->recovery_window > SD_MAX_RECOVERY_WINDOW) {
+				fprintf(stderr, "Invalid recovery window '%s': "
+					"must be an integer between 1 and %u\n",
+					optarg, SD_MAX_RECOVERY_WINDOW);
+				exit(1);
+			}
+			break;
+		case 's':
+			snapcache_size = strtoull(optarg, &p, 10);
+			if (optarg == p || snapcache_size > UINT32_MAX) {
+				fprintf(stderr, "Invalid snapshot cache size '%s'\n",
+					optarg);
+				exit(1);
+			}
+			snapcache_size *= 1024 * 1024;
+			break;
 		case 'w':
 			vprintf(SDOG_INFO, "enable write cache\n");
 			enable_write_cache = 1;
 			break;
 		case 'v':
+			if (!strcmp(optarg, "auto")) {
+				nr_vnodes = -1;
+				break;
+			}
 			nr_vnodes = strtol(optarg, &p, 10);
 			if (optarg == p || nr_vnodes < 0 || SD_MAX_VNODES < nr_vnodes) {
 				fprintf(stderr, "Invalid number of virtual nodes '%s': "
@@ -231,6 +298,14 @@ int main(int argc, char **argv)
 	if (ret)
 		exit(1);
 
+	if (nr_vnodes < 0) {
+		nr_vnodes = capacity_to_vnodes();
+		if (nr_vnodes < 0)
+			exit(1);
+	}
+
+	snapshot_cache_init(snapcache_size);
+
 	ret = init_event(EPOLL_SIZE);
 	if (ret)
 		exit(1);
@@ -249,11 +324,13 @@ int main(int argc, char **argv)
 
 	sys->gateway_wqueue = init_work_queue("gateway", false);
 	sys->io_wqueue = init_work_queue("io", false);
-	sys->recovery_wqueue = init_work_queue("recovery", true);
+	sys->recovery_wqueue = init_work_queue("recovery", false);
 	sys->deletion_wqueue = init_work_queue("deletion", true);
 	sys->block_wqueue = init_work_queue("block", true);
+	sys->warmup_wqueue = init_work_queue("warmup", true);
 	if (!sys->gateway_wqueue || !sys->io_wqueue ||!sys->recovery_wqueue ||
-	    !sys->deletion_wqueue || !sys->block_wqueue)
+	    !sys->deletion_wqueue || !sys->block_wqueue ||
+	    !sys->warmup_wqueue)
 		exit(1);
 
 	ret = init_signal();
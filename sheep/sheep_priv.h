@@ -13,6 +13,7 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <sys/time.h>
 #include <urcu/uatomic.h>
 
 #include "sheepdog_proto.h"
@@ -37,17 +38,59 @@ struct client_info {
 	int refcnt;
 };
 
+/*
+ * The arrays are sized to the membership and live in the same allocation,
+ * right after the structure.
+ */
 struct vnode_info {
-	struct sd_vnode vnodes[SD_MAX_VNODES];
+	struct sd_vnode *vnodes;
+	/* ring ids of vnodes, kept apart for a cache friendly search */
+	uint64_t *vnode_ids;
 	int nr_vnodes;
 
-	struct sd_node nodes[SD_MAX_NODES];
+	struct sd_node *nodes;
 	int nr_nodes;
 
 	int nr_zones;
 	int refcnt;
+
+	/* lookup state built by the placement driver */
+	struct placement_driver *placement;
+	uint32_t *placement_table;
+	int placement_width;
 };
 
+struct placement_driver {
+	struct list_head list;
+	const char *name;
+	int id;
+	/* build the lookup state of a new vnode_info */
+	void (*init)(struct vnode_info *vnode_info);
+	/*
+	 * store the vnode indices of the first nr_copies copies in idxs and
+	 * return how many were stored
+	 */
+	int (*oid_to_vnodes)(struct vnode_info *vnode_info, uint64_t oid,
+			     int nr_copies, int *idxs);
+};
+
+extern struct list_head placement_drivers;
+#define add_placement_driver(driver)                             \
+static void __attribute__((constructor)) add_ ## driver(void) {  \
+	list_add(&driver.list, &placement_drivers);              \
+}
+
+static inline struct placement_driver *find_placement_driver(int id)
+{
+	struct placement_driver *driver;
+
+	list_for_each_entry(driver, &placement_drivers, list) {
+		if (driver->id == id)
+			return driver;
+	}
+	return NULL;
+}
+
 struct request {
 	struct sd_req rq;
 	struct sd_rsp rp;
@@ -67,6 +110,7 @@ struct request {
 	int wait_efd;
 
 	uint64_t local_oid;
+	uint64_t queued; /* when a gateway or peer request was queued, usec */
 
 	struct vnode_info *vnodes;
 
@@ -75,11 +119,15 @@ struct request {
 
 #define MAX_OUTSTANDING_DATA_SIZE (256 * 1024 * 1024)
 
+#define SD_DEFAULT_RECOVERY_WINDOW 8
+#define SD_MAX_RECOVERY_WINDOW 64
+
 struct cluster_info {
 	struct cluster_driver *cdrv;
 	const char *cdrv_option;
 
 	int enable_write_cache;
+	uint64_t memcache_size; /* bytes of the object cache memory tier */
 
 	/* set after finishing the JOIN procedure */
 	int join_finished;
@@ -118,6 +166,7 @@ struct cluster_info {
 	unsigned int outstanding_data_size;
 
 	uint32_t recovered_epoch;
+	int recovery_window; /* objects recovered in parallel */
 
 	int use_directio;
 
@@ -126,6 +175,7 @@ struct cluster_info {
 	struct work_queue *deletion_wqueue;
 	struct work_queue *recovery_wqueue;
 	struct work_queue *block_wqueue;
+	struct work_queue *warmup_wqueue;
 };
 
 struct siocb {
@@ -145,6 +195,8 @@ struct store_driver {
 	int (*read)(uint64_t oid, struct siocb *);
 	int (*format)(struct siocb *);
 	int (*remove_object)(uint64_t oid);
+	/* Create dst as a copy of the local object src */
+	int (*copy)(uint64_t src, uint64_t dst, struct siocb *);
 	/* Operations in recovery */
 	int (*link)(uint64_t oid, struct siocb *, uint32_t tgt_epoch);
 	int (*atomic_put)(uint64_t oid, struct siocb *);
@@ -181,6 +233,8 @@ extern char *obj_path;
 extern char *mnt_path;
 extern char *jrnl_path;
 extern char *epoch_path;
+extern char *stale_path;
+extern char *deletion_path;
 extern mode_t def_fmode;
 extern mode_t def_dmode;
 
@@ -193,6 +247,7 @@ static inline uint32_t sys_epoch(void)
 int create_listen_port(int port, void *data);
 
 int init_store(const char *dir, int enable_write_cache);
+int stat_sheep(uint64_t *store_size, uint64_t *store_free, uint32_t epoch);
 int init_base_path(const char *dir);
 
 int add_vdi(char *data, int data_len, uint64_t size, uint32_t *new_vid,
@@ -205,6 +260,16 @@ int lookup_vdi(char *name, char *tag, uint32_t *vid, uint32_t snapid,
 	       unsigned int *nr_copies, uint64_t *ctime);
 
 int read_vdis(char *data, int len, unsigned int *rsp_len);
+int read_deletions(char *data, int len, unsigned int *rsp_len);
+
+void vdi_index_invalidate(uint32_t vid);
+void vdi_index_mark_deleting(uint32_t vid);
+void vdi_index_clear(void);
+void warmup_vdi_index(void);
+void add_deletion_mark(uint32_t vid);
+void resume_deletion(void);
+void clear_deletion_log(void);
+void set_deletion_rate(uint32_t max_rate);
 
 int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len, uint32_t vid,
 		uint32_t *attrid, uint64_t ctime, int write,
@@ -218,10 +283,12 @@ struct vnode_info *grab_vnode_info(struct vnode_info *vnode_info);
 struct vnode_info *get_vnode_info(void);
 void put_vnode_info(struct vnode_info *vnodes);
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch);
+void invalidate_vnode_info_epoch(uint32_t epoch);
+void refresh_vnode_info(void);
 
 struct sd_vnode *oid_to_vnode(struct vnode_info *vnode_info, uint64_t oid,
 		int copy_idx);
-void oid_to_vnodes(struct vnode_info *vnode_info, uint64_t oid, int nr_copies,
+int oid_to_vnodes(struct vnode_info *vnode_info, uint64_t oid, int nr_copies,
 		struct sd_vnode **vnodes);
 int get_nr_copies(struct vnode_info *vnode_info);
 
@@ -254,6 +321,11 @@ int get_max_nr_copies_from(struct sd_node *entries, int nr);
 int epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len);
 int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len);
 uint32_t get_latest_epoch(void);
+int stash_stale_objects(void);
+int read_stale_object(uint64_t oid, void *buf, uint32_t len);
+void remove_stale_object(uint64_t oid);
+void purge_stale_objects(void);
+void get_block_digests(const void *buf, uint32_t len, uint8_t *digests);
 int set_cluster_ctime(uint64_t ctime);
 uint64_t get_cluster_ctime(void);
 int get_obj_list(const struct sd_list_req *, struct sd_list_rsp *, void *);
@@ -264,6 +336,13 @@ void resume_recovery_work(void);
 bool oid_in_recovery(uint64_t oid);
 int is_recovery_init(void);
 int node_in_recovery(void);
+struct vnode_info *get_recovery_source(uint32_t *epoch);
+int read_object_from_source(struct vnode_info *old, struct vnode_info *cur,
+			    uint32_t epoch, uint64_t oid, char *buf,
+			    uint32_t len, uint64_t offset);
+void set_recovery_throttle(uint32_t max_rate, bool adaptive);
+int get_recovery_stat(void *buf, uint32_t len);
+void recovery_note_latency(uint64_t queued);
 
 int write_object(uint64_t oid, char *data, unsigned int datalen,
 		 uint64_t offset, uint16_t flags, int create);
@@ -375,6 +454,7 @@ int gateway_remove_obj(struct request *req);
 int peer_read_obj(struct request *req);
 int peer_write_obj(struct request *req);
 int peer_create_and_write_obj(struct request *req);
+int peer_copy_obj(struct request *req);
 int peer_remove_obj(struct request *req);
 
 /* object_cache */
@@ -393,6 +473,18 @@ void object_cache_delete(uint32_t vid);
 int object_cache_init(const char *p);
 void object_cache_remove(uint64_t oid);
 
+/* snapshot_cache */
+#define SNAPSHOT_CACHE_BLOCK_SIZE (UINT64_C(1) << 16) /* 64 KB */
+
+void snapshot_cache_init(uint64_t size);
+void snapshot_cache_invalidate(uint32_t vid);
+int snapshot_cache_enabled(void);
+int object_is_immutable(uint64_t oid);
+int snapshot_cache_read(uint64_t oid, char *buf, uint32_t len,
+			uint64_t offset);
+void snapshot_cache_insert(uint64_t oid, const char *buf, uint32_t len,
+			   uint64_t offset);
+
 /* sockfd_cache */
 struct sockfd {
 	int fd;
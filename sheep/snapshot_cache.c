@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Snapshot cache
+ *
+ * Data objects of a snapshot never change, so the gateway can keep them in
+ * memory on behalf of every VDI cloned from that snapshot. They only go
+ * away when the snapshot is deleted, because its vid can be reused by a
+ * new VDI. Blocks are keyed by oid and evicted in LRU order once the cache
+ * reaches the size given by the -s option.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sheep_priv.h"
+#include "bitops.h"
+
+#define SNAPSHOT_HASH_BITS	12
+#define SNAPSHOT_HASH_SIZE	(1 << SNAPSHOT_HASH_BITS)
+
+/* How long a VDI found writable is trusted before its inode is re-read */
+#define WRITABLE_RECHECK	10 /* seconds */
+#define WRITABLE_HASH_BITS	10
+#define WRITABLE_HASH_SIZE	(1 << WRITABLE_HASH_BITS)
+
+struct snapshot_block {
+	uint64_t oid;
+	uint32_t blk;
+	struct hlist_node hash;
+	struct list_head lru;
+	char data[0];
+};
+
+struct writable_vdi {
+	uint32_t vid;
+	time_t checked;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct hlist_head hash[SNAPSHOT_HASH_SIZE];
+	struct list_head lru;
+	size_t nr_blocks;
+	size_t max_blocks;
+
+	/* a snapshot never becomes writable again until its vid is reused */
+	DECLARE_BITMAP(snapshot_vids, SD_NR_VDIS);
+	/* bumped on every invalidation so that racing readers don't insert */
+	uint64_t gen;
+	struct writable_vdi writable[WRITABLE_HASH_SIZE];
+} snapshot_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.lru = LIST_HEAD_INIT(snapshot_cache.lru),
+};
+
+static inline struct hlist_head *snapshot_hash(uint64_t oid, uint32_t blk)
+{
+	return snapshot_cache.hash +
+		hash_64(oid + ((uint64_t)blk << 40), SNAPSHOT_HASH_BITS);
+}
+
+/* Caller should hold the snapshot_cache.lock */
+static struct snapshot_block *snapshot_block_lookup(uint64_t oid, uint32_t blk)
+{
+	struct snapshot_block *b;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(b, node, snapshot_hash(oid, blk), hash) {
+		if (b->oid == oid && b->blk == blk)
+			return b;
+	}
+	return NULL;
+}
+
+static int vdi_is_snapshot(uint32_t vid)
+{
+	struct sheepdog_inode *inode;
+	struct writable_vdi *w;
+	struct sd_req hdr;
+	time_t now = time(NULL);
+	uint64_t gen;
+	int ret;
+
+	w = snapshot_cache.writable + hash_64(vid, WRITABLE_HASH_BITS);
+
+	pthread_mutex_lock(&snapshot_cache.lock);
+	gen = snapshot_cache.gen;
+	if (test_bit(vid, snapshot_cache.snapshot_vids))
+		ret = 1;
+	else if (w->checked && w->vid == vid &&
+		 now - w->checked < WRITABLE_RECHECK)
+		ret = 0;
+	else
+		ret = -1;
+	pthread_mutex_unlock(&snapshot_cache.lock);
+	if (ret >= 0)
+		return ret;
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	sd_init_req(&hdr, SD_OP_READ_OBJ);
+	hdr.data_length = SD_INODE_HEADER_SIZE;
+	hdr.obj.oid = vid_to_vdi_oid(vid);
+	ret = exec_local_req(&hdr, inode);
+	if (ret != SD_RES_SUCCESS) {
+		dprintf("failed to read inode %"PRIx32", %x\n", vid, ret);
+		free(inode);
+		return 0;
+	}
+	ret = !!inode->snap_ctime;
+	free(inode);
+
+	pthread_mutex_lock(&snapshot_cache.lock);
+	if (gen == snapshot_cache.gen) {
+		if (ret)
+			set_bit(vid, snapshot_cache.snapshot_vids);
+		else {
+			w->vid = vid;
+			w->checked = now;
+		}
+	}
+	pthread_mutex_unlock(&snapshot_cache.lock);
+
+	return ret;
+}
+
+int snapshot_cache_enabled(void)
+{
+	return snapshot_cache.max_blocks != 0;
+}
+
+int object_is_immutable(uint64_t oid)
+{
+	if (!is_data_obj(oid))
+		return 0;
+
+	return vdi_is_snapshot(oid_to_vid(oid));
+}
+
+/* Return 0 if the whole range is served from the cache */
+int snapshot_cache_read(uint64_t oid, char *buf, uint32_t len,
+			uint64_t offset)
+{
+	uint32_t blk, start, end;
+	struct snapshot_block *b;
+	uint64_t pos, blk_off;
+	size_t n;
+
+	start = offset / SNAPSHOT_CACHE_BLOCK_SIZE;
+	end = DIV_ROUND_UP(offset + len, SNAPSHOT_CACHE_BLOCK_SIZE);
+
+	pthread_mutex_lock(&snapshot_cache.lock);
+	for (blk = start; blk < end; blk++) {
+		if (!snapshot_block_lookup(oid, blk)) {
+			pthread_mutex_unlock(&snapshot_cache.lock);
+			return -1;
+		}
+	}
+
+	for (pos = offset, blk = start; blk < end; blk++, pos += n) {
+		b = snapshot_block_lookup(oid, blk);
+		blk_off = (uint64_t)blk * SNAPSHOT_CACHE_BLOCK_SIZE;
+		n = min(blk_off + SNAPSHOT_CACHE_BLOCK_SIZE, offset + len) - pos;
+		memcpy(buf + (pos - offset), b->data + (pos - blk_off), n);
+		list_move(&b->lru, &snapshot_cache.lru);
+	}
+	pthread_mutex_unlock(&snapshot_cache.lock);
+
+	return 0;
+}
+
+/* Both offset and len must be aligned to SNAPSHOT_CACHE_BLOCK_SIZE */
+void snapshot_cache_insert(uint64_t oid, const char *buf, uint32_t len,
+			   uint64_t offset)
+{
+	uint32_t blk, start, end;
+	struct snapshot_block *b;
+
+	start = offset / SNAPSHOT_CACHE_BLOCK_SIZE;
+	end = start + len / SNAPSHOT_CACHE_BLOCK_SIZE;
+
+	pthread_mutex_lock(&snapshot_cache.lock);
+	/* the snapshot was deleted while we were reading it */
+	if (!test_bit(oid_to_vid(oid), snapshot_cache.snapshot_vids))
+		end = start;
+	for (blk = start; blk < end; blk++, buf += SNAPSHOT_CACHE_BLOCK_SIZE) {
+		if (snapshot_block_lookup(oid, blk))
+			continue;
+
+		if (snapshot_cache.nr_blocks < snapshot_cache.max_blocks) {
+			b = xmalloc(sizeof(*b) + SNAPSHOT_CACHE_BLOCK_SIZE);
+			snapshot_cache.nr_blocks++;
+		} else {
+			b = list_entry(snapshot_cache.lru.prev,
+				       struct snapshot_block, lru);
+			hlist_del(&b->hash);
+			list_del(&b->lru);
+		}
+
+		b->oid = oid;
+		b->blk = blk;
+		memcpy(b->data, buf, SNAPSHOT_CACHE_BLOCK_SIZE);
+		hlist_add_head(&b->hash, snapshot_hash(oid, blk));
+		list_add(&b->lru, &snapshot_cache.lru);
+	}
+	pthread_mutex_unlock(&snapshot_cache.lock);
+}
+
+/*
+ * Forget what we know about vid. Called on every node when a VDI is created
+ * or deleted, since the vid of a deleted snapshot can be handed to a new VDI.
+ */
+void snapshot_cache_invalidate(uint32_t vid)
+{
+	struct snapshot_block *b, *n;
+	struct writable_vdi *w;
+
+	w = snapshot_cache.writable + hash_64(vid, WRITABLE_HASH_BITS);
+
+	pthread_mutex_lock(&snapshot_cache.lock);
+	snapshot_cache.gen++;
+	clear_bit(vid, snapshot_cache.snapshot_vids);
+	if (w->vid == vid)
+		w->checked = 0;
+
+	list_for_each_entry_safe(b, n, &snapshot_cache.lru, lru) {
+		if (oid_to_vid(b->oid) != vid)
+			continue;
+		hlist_del(&b->hash);
+		list_del(&b->lru);
+		free(b);
+		snapshot_cache.nr_blocks--;
+	}
+	pthread_mutex_unlock(&snapshot_cache.lock);
+}
+
+void snapshot_cache_init(uint64_t size)
+{
+	snapshot_cache.max_blocks = size / SNAPSHOT_CACHE_BLOCK_SIZE;
+	if (snapshot_cache.max_blocks)
+		vprintf(SDOG_INFO, "snapshot cache of %zu blocks\n",
+			snapshot_cache.max_blocks);
+}
@@ -25,6 +25,7 @@
 #include "sheep_priv.h"
 #include "strbuf.h"
 #include "util.h"
+#include "sha1.h"
 #include "farm/farm.h"
 
 struct sheepdog_config {
@@ -38,6 +39,8 @@ char *obj_path;
 char *mnt_path;
 char *jrnl_path;
 char *epoch_path;
+char *stale_path;
+char *deletion_path;
 static char *config_path;
 
 mode_t def_dmode = S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP;
@@ -54,6 +57,8 @@ int update_epoch_log(uint32_t epoch, struct sd_node *nodes, size_t nr_nodes)
 
 	dprintf("update epoch: %d, %zd\n", epoch, nr_nodes);
 
+	invalidate_vnode_info_epoch(epoch);
+
 	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
 	fd = open(path, O_RDWR | O_CREAT | O_DSYNC, def_fmode);
 	if (fd < 0) {
@@ -101,14 +106,15 @@ int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len)
 		struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 		char host[128];
 		unsigned int rlen, wlen;
-		int fd;
+		struct sockfd *sfd;
 
 		if (is_myself(local_nodes[i].nid.addr, local_nodes[i].nid.port))
 			continue;
 
-		addr_to_str(host, sizeof(host), local_nodes[i].nid.addr, 0);
-		fd = connect_to(host, local_nodes[i].nid.port);
-		if (fd < 0) {
+		sfd = sheep_get_sockfd(&local_nodes[i].nid);
+		if (!sfd) {
+			addr_to_str(host, sizeof(host),
+				    local_nodes[i].nid.addr, 0);
 			vprintf(SDOG_ERR, "failed to connect to %s: %m\n", host);
 			continue;
 		}
@@ -119,8 +125,11 @@ int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len)
 
 		wlen = 0;
 
-		ret = exec_req(fd, &hdr, nodes, &wlen, &rlen);
-		close(fd);
+		ret = exec_req(sfd->fd, &hdr, nodes, &wlen, &rlen);
+		if (ret)
+			sheep_del_sockfd(&local_nodes[i].nid, sfd);
+		else
+			sheep_put_sockfd(&local_nodes[i].nid, sfd);
 
 		if (!ret && rsp->result == SD_RES_SUCCESS)
 			return rsp->data_length / sizeof(*nodes);
@@ -395,6 +404,30 @@ static int init_jrnl_path(const char *base_path)
 	return 0;
 }
 
+#define STALE_PATH "/stale/"
+
+static int init_stale_path(const char *base_path)
+{
+	int new;
+
+	stale_path = zalloc(strlen(base_path) + strlen(STALE_PATH) + 1);
+	sprintf(stale_path, "%s" STALE_PATH, base_path);
+
+	return init_path(stale_path, &new);
+}
+
+#define DELETION_PATH "/deletion/"
+
+static int init_deletion_path(const char *base_path)
+{
+	int new;
+
+	deletion_path = zalloc(strlen(base_path) + strlen(DELETION_PATH) + 1);
+	sprintf(deletion_path, "%s" DELETION_PATH, base_path);
+
+	return init_path(deletion_path, &new);
+}
+
 #define CONFIG_PATH "/config"
 
 static int init_config_path(const char *base_path)
@@ -463,6 +496,14 @@ int init_store(const char *d, int enable_write_cache)
 	if (ret)
 		return ret;
 
+	ret = init_stale_path(d);
+	if (ret)
+		return ret;
+
+	ret = init_deletion_path(d);
+	if (ret)
+		return ret;
+
 	ret = init_config_path(d);
 	if (ret)
 		return ret;
@@ -481,6 +522,94 @@ int init_store(const char *d, int enable_write_cache)
 	return ret;
 }
 
+/*
+ * Move the objects of the working directory aside when we join back after a
+ * crash. Recovery uses them as a base and only fetches the blocks that
+ * changed while we were away, see resync_stale_object().
+ */
+int stash_stale_objects(void)
+{
+	DIR *dir;
+	struct dirent *d;
+	char src[PATH_MAX], dst[PATH_MAX];
+
+	dir = opendir(obj_path);
+	if (!dir)
+		return -1;
+
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, ".", 1))
+			continue;
+		snprintf(src, sizeof(src), "%s%s", obj_path, d->d_name);
+		snprintf(dst, sizeof(dst), "%s%s", stale_path, d->d_name);
+		if (rename(src, dst) < 0) {
+			eprintf("%s:%m\n", src);
+			unlink(src);
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+int read_stale_object(uint64_t oid, void *buf, uint32_t len)
+{
+	char path[PATH_MAX];
+	int fd, ret = SD_RES_SUCCESS;
+
+	snprintf(path, sizeof(path), "%s%016"PRIx64, stale_path, oid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return SD_RES_NO_OBJ;
+
+	if (xpread(fd, buf, len, 0) != len)
+		ret = SD_RES_EIO;
+	close(fd);
+	return ret;
+}
+
+void remove_stale_object(uint64_t oid)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s%016"PRIx64, stale_path, oid);
+	unlink(path);
+}
+
+/* Fill digests with the SHA1 of every SD_RESYNC_BLOCK_SIZE block of buf */
+void get_block_digests(const void *buf, uint32_t len, uint8_t *digests)
+{
+	struct sha1_ctx ctx;
+	uint32_t off, n;
+
+	for (off = 0; off < len; off += n, digests += SHA1_LEN) {
+		n = min(len - off, (uint32_t)SD_RESYNC_BLOCK_SIZE);
+		sha1_init(&ctx);
+		sha1_update(&ctx, (const uint8_t *)buf + off, n);
+		sha1_final(&ctx, digests);
+	}
+}
+
+/* Drop the stale objects that recovery didn't need */
+void purge_stale_objects(void)
+{
+	DIR *dir;
+	struct dirent *d;
+	char p[PATH_MAX];
+
+	dir = opendir(stale_path);
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, ".", 1))
+			continue;
+		snprintf(p, sizeof(p), "%s%s", stale_path, d->d_name);
+		if (unlink(p) < 0)
+			eprintf("%s:%m\n", p);
+	}
+	closedir(dir);
+}
+
 /*
  * Write data to both local object cache (if enabled) and backends
  */
@@ -8,13 +8,261 @@
  * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 #include "sheepdog_proto.h"
 #include "sheep_priv.h"
 
+#define VDI_INDEX_HASH_BITS	12
+#define VDI_INDEX_HASH_SIZE	(1 << VDI_INDEX_HASH_BITS)
+
+/*
+ * In-memory copy of the inode header fields lookup_vdi() matches on, so
+ * that walking a chain of VDIs doesn't read an inode per step.
+ *
+ * The name, snapshot id, copies and ctime of a VDI never change, and the
+ * tag of a snapshot is frozen, so an entry stays valid until the VDI is
+ * deleted or its id reused, which every node learns through the cluster
+ * notify path. The tag of a writable VDI is rewritten by the client, so
+ * it is always read from the inode.
+ */
+struct vdi_entry {
+	uint32_t vid;
+	uint32_t snap_id;
+	uint32_t nr_copies;
+	uint32_t deleting; /* deletion started, the name may still be set */
+	uint64_t ctime;
+	uint64_t snap_ctime;
+	char name[SD_MAX_VDI_LEN];
+	char tag[SD_MAX_VDI_TAG_LEN];
+	struct hlist_node hash;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	/* bumped on every invalidation so that racing readers don't insert */
+	uint64_t gen;
+	struct hlist_head hash[VDI_INDEX_HASH_SIZE];
+} vdi_index = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Caller should hold vdi_index.lock */
+static struct vdi_entry *vdi_index_find(uint32_t vid)
+{
+	struct vdi_entry *e;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(e, node, vdi_index.hash +
+			     hash_64(vid, VDI_INDEX_HASH_BITS), hash) {
+		if (e->vid == vid)
+			return e;
+	}
+	return NULL;
+}
+
+static void fill_vdi_entry(struct vdi_entry *e,
+			   const struct sheepdog_inode *inode, uint32_t vid)
+{
+	e->vid = vid;
+	e->snap_id = inode->snap_id;
+	e->nr_copies = inode->nr_copies;
+	e->deleting = 0;
+	e->ctime = inode->ctime;
+	e->snap_ctime = inode->snap_ctime;
+	memcpy(e->name, inode->name, sizeof(e->name));
+	memcpy(e->tag, inode->tag, sizeof(e->tag));
+}
+
+/*
+ * Get the header fields of vid, from the index if possible. Set need_tag
+ * if the caller compares the tag. inode is a buffer of
+ * SD_INODE_HEADER_SIZE used when the inode has to be read.
+ */
+static int get_vdi_entry(uint32_t vid, struct sheepdog_inode *inode,
+			 struct vdi_entry *entry, bool need_tag)
+{
+	struct vdi_entry *e;
+	uint64_t gen;
+	int ret;
+
+	pthread_mutex_lock(&vdi_index.lock);
+	e = vdi_index_find(vid);
+	if (e && !e->deleting && (!need_tag || e->snap_ctime)) {
+		memcpy(entry, e, sizeof(*entry));
+		pthread_mutex_unlock(&vdi_index.lock);
+		return SD_RES_SUCCESS;
+	}
+	gen = vdi_index.gen;
+	pthread_mutex_unlock(&vdi_index.lock);
+
+	ret = read_object(vid_to_vdi_oid(vid), (char *)inode,
+			  SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	fill_vdi_entry(entry, inode, vid);
+
+	pthread_mutex_lock(&vdi_index.lock);
+	if (gen != vdi_index.gen)
+		goto out;
+
+	e = vdi_index_find(vid);
+	if (!e) {
+		e = xzalloc(sizeof(*e));
+		hlist_add_head(&e->hash, vdi_index.hash +
+			       hash_64(vid, VDI_INDEX_HASH_BITS));
+	} else if (e->deleting && inode->name[0] != '\0')
+		goto out;
+
+	fill_vdi_entry(e, inode, vid);
+out:
+	pthread_mutex_unlock(&vdi_index.lock);
+	return SD_RES_SUCCESS;
+}
+
+/* The inode of vid was created or recycled */
+void vdi_index_invalidate(uint32_t vid)
+{
+	struct vdi_entry *e;
+
+	pthread_mutex_lock(&vdi_index.lock);
+	e = vdi_index_find(vid);
+	if (e) {
+		hlist_del(&e->hash);
+		free(e);
+	}
+	vdi_index.gen++;
+	pthread_mutex_unlock(&vdi_index.lock);
+}
+
+/*
+ * The deletion of vid started somewhere in the cluster. Its inode keeps
+ * the name until the deletion work clears it, so stop trusting the entry
+ * until it is read back with an empty name.
+ */
+void vdi_index_mark_deleting(uint32_t vid)
+{
+	struct vdi_entry *e;
+
+	pthread_mutex_lock(&vdi_index.lock);
+	e = vdi_index_find(vid);
+	if (!e) {
+		e = xzalloc(sizeof(*e));
+		e->vid = vid;
+		hlist_add_head(&e->hash, vdi_index.hash +
+			       hash_64(vid, VDI_INDEX_HASH_BITS));
+	}
+	e->deleting = 1;
+	vdi_index.gen++;
+	pthread_mutex_unlock(&vdi_index.lock);
+}
+
+static void attr_index_clear(void);
+
+/* Forget everything, e.g. when the cluster is formatted or restored */
+void vdi_index_clear(void)
+{
+	struct vdi_entry *e;
+	struct hlist_node *node, *n;
+	int i;
+
+	pthread_mutex_lock(&vdi_index.lock);
+	for (i = 0; i < VDI_INDEX_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(e, node, n, vdi_index.hash + i,
+					  hash) {
+			hlist_del(&e->hash);
+			free(e);
+		}
+	}
+	vdi_index.gen++;
+	pthread_mutex_unlock(&vdi_index.lock);
+
+	attr_index_clear();
+}
+
+static void do_warmup_vdi_index(struct work *work)
+{
+	struct sheepdog_inode *inode;
+	struct vdi_entry entry;
+	unsigned long vid;
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	vid = find_next_bit(sys->vdi_inuse, SD_NR_VDIS, 0);
+	for (; vid < SD_NR_VDIS;
+	     vid = find_next_bit(sys->vdi_inuse, SD_NR_VDIS, vid + 1)) {
+		if (get_vdi_entry(vid, inode, &entry, false) != SD_RES_SUCCESS)
+			dprintf("failed to read inode %lx\n", vid);
+	}
+	free(inode);
+}
+
+static void warmup_vdi_index_done(struct work *work)
+{
+	free(work);
+}
+
+/* Load the headers of all VDIs in use into the index in the background */
+void warmup_vdi_index(void)
+{
+	struct work *work = xzalloc(sizeof(*work));
+
+	work->fn = do_warmup_vdi_index;
+	work->done = warmup_vdi_index_done;
+	queue_work(sys->warmup_wqueue, work);
+}
+
+
+/* Number of data_vdi_id entries a VDI of this size can use */
+static uint32_t nr_data_objs(uint64_t vdi_size)
+{
+	return min(DIV_ROUND_UP(vdi_size, SD_DATA_OBJ_SIZE),
+		   (uint64_t)MAX_DATA_OBJS);
+}
+
+/*
+ * Read the header of a VDI followed by the data_vdi_id entries its size
+ * covers; the rest of the array is always zero.
+ */
+static struct sheepdog_inode *read_inode_used(uint32_t vid, int *ret)
+{
+	struct sheepdog_inode *inode;
+	uint32_t nr;
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	*ret = read_object(vid_to_vdi_oid(vid), (char *)inode,
+			   SD_INODE_HEADER_SIZE, 0);
+	if (*ret != SD_RES_SUCCESS)
+		goto err;
+
+	nr = nr_data_objs(inode->vdi_size);
+	if (!nr)
+		return inode;
+
+	inode = xrealloc(inode, SD_INODE_HEADER_SIZE + sizeof(uint32_t) * nr);
+	*ret = read_object(vid_to_vdi_oid(vid), (char *)inode->data_vdi_id,
+			   sizeof(uint32_t) * nr, SD_INODE_HEADER_SIZE);
+	if (*ret != SD_RES_SUCCESS)
+		goto err;
+
+	return inode;
+err:
+	free(inode);
+	return NULL;
+}
+
+static int write_inode_field(uint32_t vid, void *field, size_t len,
+			     size_t offset)
+{
+	return write_object(vid_to_vdi_oid(vid), field, len, offset, 0, 0);
+}
 
 /* TODO: should be performed atomically */
 static int create_vdi_obj(char *name, uint32_t new_vid, uint64_t size,
@@ -22,65 +270,39 @@ static int create_vdi_obj(char *name, uint32_t new_vid, uint64_t size,
 			  int is_snapshot)
 {
 	/* we are not called concurrently */
-	struct sheepdog_inode *new = NULL, *base = NULL, *cur = NULL;
+	struct sheepdog_inode *new = NULL, *base = NULL;
 	struct timeval tv;
-	int ret = SD_RES_NO_MEM;
+	int ret, i = 0;
 	unsigned long block_size = SD_DATA_OBJ_SIZE;
-
-	new = zalloc(sizeof(*new));
-	if (!new) {
-		eprintf("failed to allocate memory\n");
-		goto out;
-	}
+	uint32_t nr_base_objs = 0;
+	uint64_t snap_ctime;
 
 	if (base_vid) {
-		base = zalloc(sizeof(*base));
+		base = read_inode_used(base_vid, &ret);
 		if (!base) {
-			eprintf("failed to allocate memory\n");
+			ret = SD_RES_BASE_VDI_READ;
 			goto out;
 		}
-	}
+		nr_base_objs = nr_data_objs(base->vdi_size);
 
-	if (is_snapshot && cur_vid != base_vid) {
-		cur = zalloc(SD_INODE_HEADER_SIZE);
-		if (!cur) {
-			eprintf("failed to allocate memory\n");
-			goto out;
+		for (i = 0; i < ARRAY_SIZE(base->child_vdi_id); i++) {
+			if (!base->child_vdi_id[i])
+				break;
 		}
-	}
-
-	if (base_vid) {
-		ret = read_object(vid_to_vdi_oid(base_vid), (char *)base,
-				  sizeof(*base), 0);
-		if (ret != SD_RES_SUCCESS) {
-			ret = SD_RES_BASE_VDI_READ;
+		if (i == ARRAY_SIZE(base->child_vdi_id)) {
+			ret = SD_RES_NO_BASE_VDI;
 			goto out;
 		}
 	}
 
-	gettimeofday(&tv, NULL);
-
-	if (is_snapshot) {
-		if (cur_vid != base_vid) {
-			vprintf(SDOG_INFO, "tree snapshot %s %" PRIx32 " %" PRIx32 "\n",
-				name, cur_vid, base_vid);
-
-			ret = read_object(vid_to_vdi_oid(cur_vid), (char *)cur,
-					  SD_INODE_HEADER_SIZE, 0);
-			if (ret != SD_RES_SUCCESS) {
-				vprintf(SDOG_ERR, "failed\n");
-				ret = SD_RES_BASE_VDI_READ;
-				goto out;
-			}
+	new = xzalloc(SD_INODE_HEADER_SIZE + sizeof(uint32_t) * nr_base_objs);
 
-			cur->snap_ctime = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
-		} else
-			base->snap_ctime = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
-	}
+	gettimeofday(&tv, NULL);
+	snap_ctime = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
 
 	strncpy(new->name, name, sizeof(new->name));
 	new->vdi_id = new_vid;
-	new->ctime = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
+	new->ctime = snap_ctime;
 	new->vdi_size = size;
 	new->copy_policy = 0;
 	new->nr_copies = sys->nr_copies;
@@ -88,37 +310,39 @@ static int create_vdi_obj(char *name, uint32_t new_vid, uint64_t size,
 	new->snap_id = snapid;
 
 	if (base_vid) {
-		int i;
-
 		new->parent_vdi_id = base_vid;
-		memcpy(new->data_vdi_id, base->data_vdi_id, sizeof(new->data_vdi_id));
+		memcpy(new->data_vdi_id, base->data_vdi_id,
+		       sizeof(uint32_t) * nr_base_objs);
+	}
 
-		for (i = 0; i < ARRAY_SIZE(base->child_vdi_id); i++) {
-			if (!base->child_vdi_id[i]) {
-				base->child_vdi_id[i] = new_vid;
-				break;
-			}
-		}
+	/*
+	 * Only the fields that change are written to the existing inodes:
+	 * snap_ctime of the VDI becoming a snapshot and one child slot.
+	 */
+	if (is_snapshot) {
+		uint32_t snap_vid = cur_vid != base_vid ? cur_vid : base_vid;
 
-		if (i == ARRAY_SIZE(base->child_vdi_id)) {
-			ret = SD_RES_NO_BASE_VDI;
-			goto out;
-		}
-	}
+		if (cur_vid != base_vid)
+			vprintf(SDOG_INFO, "tree snapshot %s %" PRIx32 " %" PRIx32 "\n",
+				name, cur_vid, base_vid);
 
-	if (is_snapshot && cur_vid != base_vid) {
-		ret = write_object(vid_to_vdi_oid(cur_vid), (char *)cur,
-				   SD_INODE_HEADER_SIZE, 0, 0, 0);
+		ret = write_inode_field(snap_vid, &snap_ctime,
+					sizeof(snap_ctime),
+					offsetof(struct sheepdog_inode,
+						 snap_ctime));
 		if (ret != 0) {
 			vprintf(SDOG_ERR, "failed\n");
-			ret = SD_RES_BASE_VDI_READ;
+			ret = cur_vid != base_vid ? SD_RES_BASE_VDI_READ :
+				SD_RES_BASE_VDI_WRITE;
 			goto out;
 		}
 	}
 
 	if (base_vid) {
-		ret = write_object(vid_to_vdi_oid(base_vid), (char *)base,
-				   SD_INODE_HEADER_SIZE, 0, 0, 0);
+		ret = write_inode_field(base_vid, &new_vid, sizeof(new_vid),
+					offsetof(struct sheepdog_inode,
+						 child_vdi_id) +
+					sizeof(uint32_t) * i);
 		if (ret != 0) {
 			vprintf(SDOG_ERR, "failed\n");
 			ret = SD_RES_BASE_VDI_WRITE;
@@ -126,14 +350,15 @@ static int create_vdi_obj(char *name, uint32_t new_vid, uint64_t size,
 		}
 	}
 
-	ret = write_object(vid_to_vdi_oid(new_vid), (char *)new, sizeof(*new),
+	/* the store zero-fills the rest of the new inode */
+	ret = write_object(vid_to_vdi_oid(new_vid), (char *)new,
+			   SD_INODE_HEADER_SIZE + sizeof(uint32_t) * nr_base_objs,
 			   0, 0, 1);
 	if (ret != 0)
 		ret = SD_RES_VDI_WRITE;
 
 out:
 	free(new);
-	free(cur);
 	free(base);
 	return ret;
 }
@@ -144,6 +369,7 @@ static int find_first_vdi(unsigned long start, unsigned long end, char *name,
 			  unsigned int *inode_nr_copies, uint64_t *ctime)
 {
 	struct sheepdog_inode *inode = NULL;
+	struct vdi_entry e;
 	unsigned long i;
 	int ret = SD_RES_NO_MEM;
 	int vdi_found = 0;
@@ -155,31 +381,37 @@ static int find_first_vdi(unsigned long start, unsigned long end, char *name,
 	}
 
 	for (i = start; i >= end; i--) {
-		ret = read_object(vid_to_vdi_oid(i), (char *)inode,
-				  SD_INODE_HEADER_SIZE, 0);
+		ret = get_vdi_entry(i, inode, &e, false);
 		if (ret != SD_RES_SUCCESS) {
 			ret = SD_RES_EIO;
 			goto out_free_inode;
 		}
 
-		if (inode->name[0] == '\0') {
+		if (e.name[0] == '\0') {
 			*deleted_nr = i;
 			continue; /* deleted */
 		}
 
-		if (!strncmp(inode->name, name, strlen(inode->name))) {
+		if (!strncmp(e.name, name, strlen(e.name))) {
 			vdi_found = 1;
-			if (tag && tag[0] &&
-			    strncmp(inode->tag, tag, sizeof(inode->tag)) != 0)
-				continue;
-			if (snapid && snapid != inode->snap_id)
+			if (tag && tag[0]) {
+				if (!e.snap_ctime &&
+				    get_vdi_entry(i, inode, &e, true) !=
+				    SD_RES_SUCCESS) {
+					ret = SD_RES_EIO;
+					goto out_free_inode;
+				}
+				if (strncmp(e.tag, tag, sizeof(e.tag)) != 0)
+					continue;
+			}
+			if (snapid && snapid != e.snap_id)
 				continue;
 
-			*next_snap = inode->snap_id + 1;
-			*vid = inode->vdi_id;
-			*inode_nr_copies = inode->nr_copies;
+			*next_snap = e.snap_id + 1;
+			*vid = e.vid;
+			*inode_nr_copies = e.nr_copies;
 			if (ctime)
-				*ctime = inode->ctime;
+				*ctime = e.ctime;
 			ret = SD_RES_SUCCESS;
 			goto out_free_inode;
 		}
@@ -352,15 +584,207 @@ struct deletion_work {
 	struct work work;
 	struct list_head dw_siblings;
 	struct request *req;
+	struct vnode_info *vnodes;
+	uint32_t epoch; /* the epoch of vnodes */
 
 	uint32_t vid;
+	int interrupted;
 
 	int count;
 	uint32_t *buf;
+	/* ctime of each VDI in buf, to tell it from a later VDI reusing the vid */
+	uint64_t *ctimes;
 };
 
 static LIST_HEAD(deletion_work_list);
 
+/*
+ * Deletion log
+ *
+ * Every pending deletion has a log object holding the list of VDIs whose
+ * objects are removed, how many of them are done and the node doing the
+ * work. It is replicated like any other object, so the deletion goes on
+ * where it stopped when that node restarts, and the first node of the
+ * cluster takes it over when that node leaves for good. The object goes
+ * away with the last VDI.
+ *
+ * Every node keeps an empty file named after the deleted vid in
+ * deletion_path for each deletion it heard of, to know which logs to
+ * look at after a membership change, and a joining node copies them from
+ * the others. A file whose log is gone is removed then.
+ *
+ * A finished VDI loses its name and its vid may be handed out again, so
+ * the log keeps each VDI's ctime and delete_one() leaves alone any inode
+ * which doesn't match it.
+ */
+struct deletion_log_entry {
+	uint32_t vid;
+	uint32_t reserved;
+	uint64_t ctime;
+};
+
+struct deletion_log {
+	uint32_t done;
+	uint32_t count;
+	struct node_id owner;
+	uint8_t reserved[6];
+	struct deletion_log_entry entries[0];
+};
+
+#define DELETION_LOG_MAX_ENTRIES \
+	((SD_DATA_OBJ_SIZE - sizeof(struct deletion_log)) / \
+	 sizeof(struct deletion_log_entry))
+
+/* objects removed per second, 0 means unlimited */
+static uint32_t deletion_rate;
+
+void set_deletion_rate(uint32_t max_rate)
+{
+	uatomic_set(&deletion_rate, max_rate);
+	vprintf(SDOG_INFO, "deletion rate %"PRIu32" objects/s\n", max_rate);
+}
+
+/*
+ * The log is kept in the vmstate space of the deleted VDI, at an index
+ * no VM state can reach.
+ */
+static uint64_t vid_to_deletion_oid(uint32_t vid)
+{
+	return VMSTATE_BIT | ((uint64_t)vid << VDI_SPACE_SHIFT) | UINT32_MAX;
+}
+
+static void deletion_mark_path(char *path, size_t len, uint32_t vid)
+{
+	snprintf(path, len, "%s%08"PRIx32, deletion_path, vid);
+}
+
+/* Remember that the deletion of vid started somewhere in the cluster */
+void add_deletion_mark(uint32_t vid)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	deletion_mark_path(path, sizeof(path), vid);
+	fd = open(path, O_WRONLY | O_CREAT, def_fmode);
+	if (fd < 0) {
+		eprintf("failed to create %s, %m\n", path);
+		return;
+	}
+	close(fd);
+}
+
+static void remove_deletion_mark(uint32_t vid)
+{
+	char path[PATH_MAX];
+
+	deletion_mark_path(path, sizeof(path), vid);
+	if (unlink(path) < 0 && errno != ENOENT)
+		eprintf("failed to remove %s, %m\n", path);
+}
+
+static int deletion_log_create(struct deletion_work *dw)
+{
+	struct deletion_log *log;
+	size_t len = sizeof(*log) + sizeof(log->entries[0]) * dw->count;
+	int i, ret;
+
+	if (dw->count > DELETION_LOG_MAX_ENTRIES) {
+		eprintf("too many VDIs to log, %d\n", dw->count);
+		return SD_RES_EIO;
+	}
+
+	log = xzalloc(len);
+	log->done = dw->done;
+	log->count = dw->count;
+	log->owner = sys->this_node.nid;
+	for (i = 0; i < dw->count; i++) {
+		log->entries[i].vid = dw->buf[i];
+		log->entries[i].ctime = dw->ctimes[i];
+	}
+
+	ret = write_object(vid_to_deletion_oid(dw->vid), (char *)log, len,
+			   0, 0, 1);
+	free(log);
+	return ret;
+}
+
+static void deletion_log_update(struct deletion_work *dw, uint32_t done)
+{
+	uint64_t oid = vid_to_deletion_oid(dw->vid);
+
+	if (done == dw->count) {
+		if (remove_object(oid) == SD_RES_SUCCESS)
+			remove_deletion_mark(dw->vid);
+		return;
+	}
+
+	write_object(oid, (char *)&done, sizeof(done),
+		     offsetof(struct deletion_log, done), 0, 0);
+}
+
+/* Drop the marks of pending deletions, every node does it on format */
+void clear_deletion_log(void)
+{
+	DIR *dir;
+	struct dirent *d;
+	char p[PATH_MAX];
+
+	dir = opendir(deletion_path);
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, ".", 1))
+			continue;
+		snprintf(p, sizeof(p), "%s%s", deletion_path, d->d_name);
+		if (unlink(p) < 0)
+			eprintf("%s:%m\n", p);
+	}
+	closedir(dir);
+}
+
+/* Fill a bitmap of the deletions this node knows of for a joining node */
+int read_deletions(char *data, int len, unsigned int *rsp_len)
+{
+	unsigned long *bitmap = (unsigned long *)data;
+	struct dirent *d;
+	uint32_t vid;
+	char *p;
+	DIR *dir;
+
+	if (len != sizeof(sys->vdi_inuse))
+		return SD_RES_INVALID_PARMS;
+
+	memset(bitmap, 0, len);
+	*rsp_len = len;
+
+	dir = opendir(deletion_path);
+	if (!dir)
+		return SD_RES_SUCCESS;
+
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, ".", 1))
+			continue;
+		vid = strtoul(d->d_name, &p, 16);
+		if (*p || vid >= SD_NR_VDIS)
+			continue;
+		set_bit(vid, bitmap);
+	}
+	closedir(dir);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Sleep until nr objects removed since start fit in the deletion rate */
+static void throttle_deletion(int nr, uint32_t rate, uint64_t start)
+{
+	uint64_t elapsed, wanted = (uint64_t)nr * 1000000 / rate;
+
+	elapsed = monotonic_usec() - start;
+	if (elapsed < wanted)
+		usleep(wanted - elapsed);
+}
+
 static int delete_inode(struct deletion_work *dw)
 {
 	struct sheepdog_inode *inode = NULL;
@@ -394,33 +818,279 @@ out:
 }
 
 
+/* Number of oids sent in one SD_OP_REMOVE_OBJS request */
+#define DELETION_BATCH 1024
+/* How often a recovering node is asked again before we give up on it */
+#define DELETION_MAX_RETRIES 10
+#define DELETION_RETRY_INTERVAL 1 /* sec */
+
+/* Objects of the VDI being deleted which have a copy on one node */
+struct deletion_target {
+	uint64_t *oids;
+	int nr;
+	int pos;
+	int nr_retries;
+
+	/* batch in flight */
+	struct sockfd *sfd;
+	int nr_sent;
+};
+
+/* Objects to remove through the gateway at the end of a round */
+struct deletion_fallback {
+	uint64_t *oids;
+	int nr;
+};
+
+static void remove_objects_slowly(uint64_t *oids, int nr)
+{
+	int i, ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = remove_object(oids[i]);
+		if (ret != SD_RES_SUCCESS)
+			eprintf("remove object %" PRIx64 " fail, %d\n",
+				oids[i], ret);
+	}
+}
+
+static void add_fallback(struct deletion_fallback *f, uint64_t *oids, int nr)
+{
+	f->oids = xrealloc(f->oids, sizeof(*f->oids) * (f->nr + nr));
+	memcpy(f->oids + f->nr, oids, sizeof(*oids) * nr);
+	f->nr += nr;
+}
+
+static int oid_cmp(const void *a, const void *b)
+{
+	const uint64_t *oid1 = a, *oid2 = b;
+
+	if (*oid1 < *oid2)
+		return -1;
+	return *oid1 > *oid2;
+}
+
+/*
+ * The gateway removes every copy of an object, so drop the objects it
+ * removes from what is left for the other nodes, and each object is
+ * removed only once.
+ */
+static void flush_fallback(struct deletion_fallback *f,
+			   struct deletion_target *targets, int nr_targets)
+{
+	struct deletion_target *t;
+	int i, j, n;
+
+	if (!f->nr)
+		return;
+
+	qsort(f->oids, f->nr, sizeof(*f->oids), oid_cmp);
+	for (i = 1, n = 1; i < f->nr; i++) {
+		if (f->oids[i] != f->oids[n - 1])
+			f->oids[n++] = f->oids[i];
+	}
+	f->nr = n;
+
+	dprintf("removing %d objects through the gateway\n", f->nr);
+	remove_objects_slowly(f->oids, f->nr);
+
+	for (i = 0; i < nr_targets; i++) {
+		t = targets + i;
+		for (j = n = t->pos; j < t->nr; j++) {
+			if (!bsearch(t->oids + j, f->oids, f->nr,
+				     sizeof(*f->oids), oid_cmp))
+				t->oids[n++] = t->oids[j];
+		}
+		t->nr = n;
+	}
+	f->nr = 0;
+}
+
+static void group_objects(struct vnode_info *vnodes, uint64_t *oids, int nr,
+			  struct deletion_target *targets)
+{
+	struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	int nr_copies = get_nr_copies(vnodes), nr_found, i, j;
+	struct deletion_target *t;
+	struct sd_node key, *n;
+
+	memset(&key, 0, sizeof(key));
+	for (i = 0; i < nr; i++) {
+		nr_found = oid_to_vnodes(vnodes, oids[i], nr_copies, obj_vnodes);
+		for (j = 0; j < nr_found; j++) {
+			key.nid = obj_vnodes[j]->nid;
+			n = bsearch(&key, vnodes->nodes, vnodes->nr_nodes,
+				    sizeof(key), node_id_cmp);
+			t = targets + (n - vnodes->nodes);
+			if (t->nr % DELETION_BATCH == 0)
+				t->oids = xrealloc(t->oids, sizeof(*t->oids) *
+						   (t->nr + DELETION_BATCH));
+			t->oids[t->nr++] = oids[i];
+		}
+	}
+}
+
+static void send_deletion_batch(struct node_id *nid, struct deletion_target *t,
+				uint32_t epoch, struct deletion_fallback *f)
+{
+	struct sd_req hdr;
+	unsigned wlen;
+	int nr = min(t->nr - t->pos, DELETION_BATCH);
+
+	sd_init_req(&hdr, SD_OP_REMOVE_OBJS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.epoch = epoch;
+	hdr.data_length = wlen = nr * sizeof(*t->oids);
+
+	t->sfd = sheep_get_sockfd(nid);
+	if (!t->sfd)
+		goto fallback;
+
+	if (send_req(t->sfd->fd, &hdr, t->oids + t->pos, &wlen)) {
+		sheep_del_sockfd(nid, t->sfd);
+		t->sfd = NULL;
+		goto fallback;
+	}
+	t->nr_sent = nr;
+	return;
+fallback:
+	add_fallback(f, t->oids + t->pos, nr);
+	t->pos += nr;
+}
+
+/* Returns 1 if the batch should be sent to the node again later */
+static int wait_deletion_batch(struct node_id *nid, struct deletion_target *t,
+			       struct deletion_fallback *f)
+{
+	uint64_t left[DELETION_BATCH];
+	struct sd_rsp rsp;
+	int retry = 0;
+
+	if (do_read(t->sfd->fd, &rsp, sizeof(rsp)) ||
+	    (rsp.data_length &&
+	     do_read(t->sfd->fd, left, min(rsp.data_length,
+					   (uint32_t)sizeof(left))))) {
+		sheep_del_sockfd(nid, t->sfd);
+		add_fallback(f, t->oids + t->pos, t->nr_sent);
+		goto out;
+	}
+	sheep_put_sockfd(nid, t->sfd);
+
+	switch (rsp.result) {
+	case SD_RES_SUCCESS:
+		t->nr_retries = 0;
+		add_fallback(f, left, rsp.data_length / sizeof(left[0]));
+		break;
+	case SD_RES_OBJ_RECOVERING:
+		/* ask again once it may be done recovering */
+		if (++t->nr_retries <= DELETION_MAX_RETRIES) {
+			retry = 1;
+			break;
+		}
+		/* fall through */
+	default:
+		dprintf("%x, falling back to the gateway\n", rsp.result);
+		add_fallback(f, t->oids + t->pos, t->nr_sent);
+		break;
+	}
+out:
+	t->sfd = NULL;
+	if (!retry)
+		t->pos += t->nr_sent;
+	t->nr_sent = 0;
+	return retry;
+}
+
+/*
+ * Remove the objects in batches, one batch in flight per node. A node
+ * which is recovering is asked again a bit later. Objects a node can't
+ * remove, or which a node still rejects after DELETION_MAX_RETRIES, are
+ * removed through the gateway once per round.
+ */
+static void remove_objects(struct vnode_info *vnodes, uint32_t epoch,
+			   uint64_t *oids, int nr)
+{
+	struct deletion_target *targets;
+	struct deletion_fallback f = { NULL, 0 };
+	int i, nr_left, retry;
+
+	targets = xzalloc(sizeof(*targets) * vnodes->nr_nodes);
+	group_objects(vnodes, oids, nr, targets);
+
+	do {
+		for (i = 0; i < vnodes->nr_nodes; i++) {
+			if (targets[i].pos < targets[i].nr)
+				send_deletion_batch(&vnodes->nodes[i].nid,
+						    targets + i, epoch, &f);
+		}
+
+		retry = 0;
+		for (i = 0; i < vnodes->nr_nodes; i++) {
+			if (targets[i].sfd)
+				retry |= wait_deletion_batch(
+					&vnodes->nodes[i].nid, targets + i, &f);
+		}
+
+		flush_fallback(&f, targets, vnodes->nr_nodes);
+
+		nr_left = 0;
+		for (i = 0; i < vnodes->nr_nodes; i++)
+			nr_left += targets[i].nr - targets[i].pos;
+
+		if (retry)
+			sleep(DELETION_RETRY_INTERVAL);
+	} while (nr_left);
+
+	for (i = 0; i < vnodes->nr_nodes; i++)
+		free(targets[i].oids);
+	free(targets);
+	free(f.oids);
+}
+
 static void delete_one(struct work *work)
 {
 	struct deletion_work *dw = container_of(work, struct deletion_work, work);
-	uint32_t vdi_id = *(dw->buf + dw->count - dw->done - 1);
-	int ret, i;
+	int idx = dw->count - dw->done - 1;
+	uint32_t vdi_id = dw->buf[idx];
+	int ret, i, n, nr_objs = 0;
 	struct sheepdog_inode *inode = NULL;
+	uint64_t *oids = NULL;
+	uint64_t start;
+	uint32_t rate, nr;
 
 	eprintf("%d %d, %16x\n", dw->done, dw->count, vdi_id);
 
-	inode = malloc(sizeof(*inode));
+	inode = read_inode_used(vdi_id, &ret);
 	if (!inode) {
-		eprintf("failed to allocate memory\n");
+		eprintf("cannot find VDI object\n");
+		/* leave the rest in the log for the next membership change */
+		if (ret != SD_RES_NO_OBJ)
+			dw->interrupted = 1;
 		goto out;
 	}
 
-	ret = read_object(vid_to_vdi_oid(vdi_id),
-			  (void *)inode, sizeof(*inode), 0);
-
-	if (ret != SD_RES_SUCCESS) {
-		eprintf("cannot find VDI object\n");
-		goto out;
+	/*
+	 * Only the VDI being deleted may still have a name, and a different
+	 * ctime means its vid went to a new VDI after we were done with it.
+	 */
+	if (inode->ctime != dw->ctimes[idx] ||
+	    (inode->name[0] != '\0' && vdi_id != dw->vid)) {
+		dprintf("VDI %" PRIx32 " is not ours anymore, skipping\n",
+			vdi_id);
+		goto done;
 	}
 
 	if (inode->vdi_size == 0 && inode->name[0] == '\0')
-		goto out;
+		goto done;
 
-	for (i = 0; i < MAX_DATA_OBJS; i++) {
+	nr = nr_data_objs(inode->vdi_size);
+	for (i = 0; i < nr; i++) {
+		if (inode->data_vdi_id[i] == inode->vdi_id)
+			nr_objs++;
+	}
+
+	oids = xmalloc(sizeof(*oids) * (nr_objs + 1));
+	for (i = 0, nr_objs = 0; i < nr; i++) {
 		uint64_t oid;
 
 		if (!inode->data_vdi_id[i])
@@ -434,21 +1104,33 @@ static void delete_one(struct work *work)
 			continue;
 		}
 
-		ret = remove_object(oid);
+		oids[nr_objs++] = oid;
+	}
 
-		if (ret != SD_RES_SUCCESS)
-			eprintf("remove object %" PRIx64 " fail, %d\n", oid, ret);
+	for (i = 0; i < nr_objs; i += n) {
+		rate = uatomic_read(&deletion_rate);
+		n = nr_objs - i;
+		if (rate)
+			n = min((uint32_t)n, rate);
+
+		start = monotonic_usec();
+		remove_objects(dw->vnodes, dw->epoch, oids + i, n);
+		if (rate)
+			throttle_deletion(n, rate, start);
 	}
 
 	if (*(inode->name) == '\0')
-		goto out;
+		goto done;
 
 	inode->vdi_size = 0;
 	memset(inode->name, 0, sizeof(inode->name));
 
 	write_object(vid_to_vdi_oid(vdi_id), (void *)inode,
-		     sizeof(*inode), 0, 0, 0);
+		     SD_INODE_HEADER_SIZE, 0, 0, 0);
+done:
+	deletion_log_update(dw, dw->done + 1);
 out:
+	free(oids);
 	free(inode);
 }
 
@@ -457,23 +1139,35 @@ static void delete_one_done(struct work *work)
 	struct deletion_work *dw = container_of(work, struct deletion_work, work);
 	struct request *req = dw->req;
 
-	dw->done++;
-	if (dw->done < dw->count) {
+	/* pick up membership changes between VDIs */
+	put_vnode_info(dw->vnodes);
+
+	if (dw->interrupted)
+		vprintf(SDOG_ERR, "deletion of %"PRIx32" interrupted, %d/%d "
+			"done\n", dw->vid, dw->done, dw->count);
+	else if (++dw->done < dw->count) {
+		dw->vnodes = get_vnode_info();
+		dw->epoch = sys->epoch;
 		queue_work(sys->deletion_wqueue, &dw->work);
 		return;
 	}
 
 	list_del(&dw->dw_siblings);
 
-	put_request(req);
+	if (req)
+		put_request(req);
 
 	free(dw->buf);
+	free(dw->ctimes);
 	free(dw);
 
 	if (!list_empty(&deletion_work_list)) {
 		dw = list_first_entry(&deletion_work_list,
 				      struct deletion_work, dw_siblings);
 
+		put_vnode_info(dw->vnodes);
+		dw->vnodes = get_vnode_info();
+		dw->epoch = sys->epoch;
 		queue_work(sys->deletion_wqueue, &dw->work);
 	}
 }
@@ -522,6 +1216,34 @@ out:
 	return 1;
 }
 
+/* Record the ctime of each VDI in the list before it is logged */
+static int get_vdi_ctimes(struct deletion_work *dw)
+{
+	struct sheepdog_inode *inode;
+	int i, ret = SD_RES_SUCCESS;
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	dw->ctimes = xzalloc(sizeof(*dw->ctimes) * dw->count);
+	for (i = 0; i < dw->count; i++) {
+		ret = read_object(vid_to_vdi_oid(dw->buf[i]), (char *)inode,
+				  SD_INODE_HEADER_SIZE, 0);
+		if (ret == SD_RES_NO_OBJ) {
+			/* delete_one() skips it unless it comes back */
+			ret = SD_RES_SUCCESS;
+			continue;
+		}
+		if (ret != SD_RES_SUCCESS) {
+			eprintf("cannot read VDI %" PRIx32 ", %x\n",
+				dw->buf[i], ret);
+			break;
+		}
+		dw->ctimes[i] = inode->ctime;
+	}
+	free(inode);
+
+	return ret;
+}
+
 static uint64_t get_vdi_root(uint32_t vid, int *cloned)
 {
 	int ret;
@@ -614,7 +1336,17 @@ static int start_deletion(struct request *req, uint32_t vid)
 	if (dw->count == 0)
 		goto out;
 
+	ret = get_vdi_ctimes(dw);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+
+	ret = deletion_log_create(dw);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+
 	uatomic_inc(&req->refcnt);
+	dw->vnodes = grab_vnode_info(req->vnodes);
+	dw->epoch = req->rq.epoch;
 
 	if (list_empty(&deletion_work_list)) {
 		list_add_tail(&dw->dw_siblings, &deletion_work_list);
@@ -624,13 +1356,320 @@ static int start_deletion(struct request *req, uint32_t vid)
 out:
 	return SD_RES_SUCCESS;
 err:
-	if (dw)
+	if (dw) {
 		free(dw->buf);
+		free(dw->ctimes);
+	}
 	free(dw);
 
 	return ret;
 }
 
+static struct deletion_work *find_deletion_work(uint32_t vid)
+{
+	struct deletion_work *dw;
+
+	list_for_each_entry(dw, &deletion_work_list, dw_siblings) {
+		if (dw->vid == vid)
+			return dw;
+	}
+	return NULL;
+}
+
+static bool node_is_member(const struct node_id *nid,
+			   struct vnode_info *vnodes)
+{
+	int i;
+
+	for (i = 0; i < vnodes->nr_nodes; i++) {
+		if (!node_id_cmp(&vnodes->nodes[i].nid, nid))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Load the log of vid if its deletion is ours to run: either we started
+ * it, or its node has left and we are the first node of the cluster.
+ */
+static struct deletion_work *load_deletion_log(uint32_t vid,
+					       struct vnode_info *vnodes)
+{
+	uint64_t oid = vid_to_deletion_oid(vid);
+	struct deletion_work *dw = NULL;
+	struct deletion_log log;
+	struct deletion_log_entry *entries = NULL;
+	char name[128];
+	size_t len;
+	int i, ret;
+
+	ret = read_object(oid, (char *)&log, sizeof(log), 0);
+	if (ret == SD_RES_NO_OBJ) {
+		/* finished, or never needed a log */
+		remove_deletion_mark(vid);
+		return NULL;
+	}
+	if (ret != SD_RES_SUCCESS)
+		return NULL;
+
+	if (log.done >= log.count || log.count > DELETION_LOG_MAX_ENTRIES) {
+		eprintf("corrupted deletion log of %"PRIx32"\n", vid);
+		return NULL;
+	}
+
+	if (node_id_cmp(&log.owner, &sys->this_node.nid)) {
+		if (node_is_member(&log.owner, vnodes) ||
+		    !node_eq(&vnodes->nodes[0], &sys->this_node))
+			return NULL;
+
+		addr_to_str(name, sizeof(name), log.owner.addr, log.owner.port);
+		vprintf(SDOG_INFO, "taking over deletion of %"PRIx32" from "
+			"%s\n", vid, name);
+		log.owner = sys->this_node.nid;
+		ret = write_object(oid, (char *)&log.owner, sizeof(log.owner),
+				   offsetof(struct deletion_log, owner), 0, 0);
+		if (ret != SD_RES_SUCCESS)
+			return NULL;
+	}
+
+	len = sizeof(*entries) * log.count;
+	entries = xmalloc(len);
+	ret = read_object(oid, (char *)entries, len, sizeof(log));
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	dw = xzalloc(sizeof(*dw));
+	dw->buf = xzalloc(SD_INODE_SIZE - SD_INODE_HEADER_SIZE);
+	dw->ctimes = xmalloc(sizeof(*dw->ctimes) * log.count);
+	for (i = 0; i < log.count; i++) {
+		dw->buf[i] = entries[i].vid;
+		dw->ctimes[i] = entries[i].ctime;
+	}
+
+	dw->vid = vid;
+	dw->done = log.done;
+	dw->count = log.count;
+	dw->work.fn = delete_one;
+	dw->work.done = delete_one_done;
+out:
+	free(entries);
+	return dw;
+}
+
+struct deletion_scan {
+	struct work work;
+	/* the membership the owners of the logs are checked against */
+	struct vnode_info *vnodes;
+	struct list_head dw_list;
+};
+
+static void do_resume_deletion(struct work *work)
+{
+	struct deletion_scan *s = container_of(work, struct deletion_scan,
+					       work);
+	struct deletion_work *dw;
+	struct dirent *d;
+	uint32_t vid;
+	char *p;
+	DIR *dir;
+
+	dir = opendir(deletion_path);
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, ".", 1))
+			continue;
+
+		vid = strtoul(d->d_name, &p, 16);
+		if (*p)
+			continue;
+
+		dw = load_deletion_log(vid, s->vnodes);
+		if (dw)
+			list_add_tail(&dw->dw_siblings, &s->dw_list);
+	}
+	closedir(dir);
+}
+
+static void resume_deletion_done(struct work *work)
+{
+	struct deletion_scan *s = container_of(work, struct deletion_scan,
+					       work);
+	struct deletion_work *dw, *n;
+	int empty;
+
+	list_for_each_entry_safe(dw, n, &s->dw_list, dw_siblings) {
+		list_del(&dw->dw_siblings);
+		if (find_deletion_work(dw->vid)) {
+			free(dw->buf);
+			free(dw->ctimes);
+			free(dw);
+			continue;
+		}
+
+		vprintf(SDOG_INFO, "resuming deletion of %"PRIx32", %d/%d "
+			"done\n", dw->vid, dw->done, dw->count);
+
+		dw->vnodes = get_vnode_info();
+		dw->epoch = sys->epoch;
+		empty = list_empty(&deletion_work_list);
+		list_add_tail(&dw->dw_siblings, &deletion_work_list);
+		if (empty)
+			queue_work(sys->deletion_wqueue, &dw->work);
+	}
+
+	put_vnode_info(s->vnodes);
+	free(s);
+}
+
+/*
+ * Requeue the deletions this node didn't finish before it went away and
+ * the ones left behind by nodes which are gone. Called when the node
+ * joins and after a node leaves.
+ */
+void resume_deletion(void)
+{
+	struct deletion_scan *s = xzalloc(sizeof(*s));
+
+	s->vnodes = get_vnode_info();
+	INIT_LIST_HEAD(&s->dw_list);
+	s->work.fn = do_resume_deletion;
+	s->work.done = resume_deletion_done;
+	queue_work(sys->deletion_wqueue, &s->work);
+}
+
+#define ATTR_INDEX_HASH_BITS	10
+#define ATTR_INDEX_HASH_SIZE	(1 << ATTR_INDEX_HASH_BITS)
+
+/* Size of the attribute fields get_vdi_attr() matches on */
+#define SD_ATTR_HEADER_SIZE offsetof(struct sheepdog_vdi_attr, value)
+
+/*
+ * Where the attributes found so far live, keyed by the hash their probe
+ * starts from. Attribute slots are never reused, so an entry can only
+ * turn stale by the attribute being deleted, possibly from another node;
+ * the header read that confirms a hit notices that.
+ */
+struct attr_entry {
+	uint32_t vid;
+	uint32_t attrid;
+	uint64_t hval;
+	struct hlist_node hash;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct hlist_head hash[ATTR_INDEX_HASH_SIZE];
+} attr_index = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Caller should hold attr_index.lock */
+static struct attr_entry *attr_index_find(uint32_t vid, uint64_t hval)
+{
+	struct attr_entry *e;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(e, node, attr_index.hash +
+			     hash_64(hval, ATTR_INDEX_HASH_BITS), hash) {
+		if (e->vid == vid && e->hval == hval)
+			return e;
+	}
+	return NULL;
+}
+
+static int attr_index_lookup(uint32_t vid, uint64_t hval, uint32_t *attrid)
+{
+	struct attr_entry *e;
+
+	pthread_mutex_lock(&attr_index.lock);
+	e = attr_index_find(vid, hval);
+	if (e)
+		*attrid = e->attrid;
+	pthread_mutex_unlock(&attr_index.lock);
+
+	return e != NULL;
+}
+
+static void attr_index_insert(uint32_t vid, uint64_t hval, uint32_t attrid)
+{
+	struct attr_entry *e;
+
+	pthread_mutex_lock(&attr_index.lock);
+	e = attr_index_find(vid, hval);
+	if (!e) {
+		e = xmalloc(sizeof(*e));
+		e->vid = vid;
+		e->hval = hval;
+		hlist_add_head(&e->hash, attr_index.hash +
+			       hash_64(hval, ATTR_INDEX_HASH_BITS));
+	}
+	e->attrid = attrid;
+	pthread_mutex_unlock(&attr_index.lock);
+}
+
+static void attr_index_remove(uint32_t vid, uint64_t hval)
+{
+	struct attr_entry *e;
+
+	pthread_mutex_lock(&attr_index.lock);
+	e = attr_index_find(vid, hval);
+	if (e) {
+		hlist_del(&e->hash);
+		free(e);
+	}
+	pthread_mutex_unlock(&attr_index.lock);
+}
+
+static void attr_index_clear(void)
+{
+	struct attr_entry *e;
+	struct hlist_node *node, *n;
+	int i;
+
+	pthread_mutex_lock(&attr_index.lock);
+	for (i = 0; i < ATTR_INDEX_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(e, node, n, attr_index.hash + i,
+					  hash) {
+			hlist_del(&e->hash);
+			free(e);
+		}
+	}
+	pthread_mutex_unlock(&attr_index.lock);
+}
+
+static bool attr_matches(const struct sheepdog_vdi_attr *a,
+			 const struct sheepdog_vdi_attr *b)
+{
+	return strcmp(a->name, b->name) == 0 &&
+		strcmp(a->tag, b->tag) == 0 &&
+		a->snap_id == b->snap_id &&
+		strcmp(a->key, b->key) == 0;
+}
+
+/* Apply the request to the attribute found in slot oid */
+static int update_vdi_attr(struct sheepdog_vdi_attr *vattr, uint64_t oid,
+			   int wr, int excl, int delete)
+{
+	int ret;
+
+	if (excl)
+		return SD_RES_VDI_EXIST;
+
+	if (delete)
+		ret = write_object(oid, (char *)"", 1,
+				   offsetof(struct sheepdog_vdi_attr, name),
+				   0, 0);
+	else if (wr)
+		ret = write_object(oid, (char *)vattr, SD_ATTR_OBJ_SIZE,
+				   0, 0, 0);
+	else
+		return SD_RES_SUCCESS;
+
+	return ret ? SD_RES_EIO : SD_RES_SUCCESS;
+}
+
 int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len,
 		 uint32_t vid, uint32_t *attrid, uint64_t ctime,
 		 int wr, int excl, int delete)
@@ -647,21 +1686,33 @@ int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len,
 	hval = fnv_64a_buf(vattr->tag, sizeof(vattr->tag), hval);
 	hval = fnv_64a_buf(&vattr->snap_id, sizeof(vattr->snap_id), hval);
 	hval = fnv_64a_buf(vattr->key, sizeof(vattr->key), hval);
+
+	if (attr_index_lookup(vid, hval, attrid)) {
+		oid = vid_to_attr_oid(vid, *attrid);
+		ret = read_object(oid, (char *)&tmp_attr,
+				  SD_ATTR_HEADER_SIZE, 0);
+		if (ret == SD_RES_SUCCESS && attr_matches(&tmp_attr, vattr))
+			goto found;
+		attr_index_remove(vid, hval);
+	}
+
 	*attrid = hval & ((UINT64_C(1) << VDI_SPACE_SHIFT) - 1);
 
 	end = *attrid - 1;
 	while (*attrid != end) {
 		oid = vid_to_attr_oid(vid, *attrid);
 		ret = read_object(oid, (char *)&tmp_attr,
-				  sizeof(tmp_attr), 0);
+				  SD_ATTR_HEADER_SIZE, 0);
 
 		if (ret == SD_RES_NO_OBJ && wr) {
 			ret = write_object(oid, (char *)vattr,
 					   data_len, 0, 0, 1);
 			if (ret)
 				ret = SD_RES_EIO;
-			else
+			else {
+				attr_index_insert(vid, hval, *attrid);
 				ret = SD_RES_SUCCESS;
+			}
 			goto out;
 		}
 
@@ -669,31 +1720,9 @@ int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len,
 			goto out;
 
 		/* compare attribute header */
-		if (strcmp(tmp_attr.name, vattr->name) == 0 &&
-		    strcmp(tmp_attr.tag, vattr->tag) == 0 &&
-		    tmp_attr.snap_id == vattr->snap_id &&
-		    strcmp(tmp_attr.key, vattr->key) == 0) {
-			if (excl)
-				ret = SD_RES_VDI_EXIST;
-			else if (delete) {
-				ret = write_object(oid, (char *)"", 1,
-						   offsetof(struct sheepdog_vdi_attr, name),
-						   0, 0);
-				if (ret)
-					ret = SD_RES_EIO;
-				else
-					ret = SD_RES_SUCCESS;
-			} else if (wr) {
-				ret = write_object(oid, (char *)vattr,
-						   SD_ATTR_OBJ_SIZE, 0, 0, 0);
-
-				if (ret)
-					ret = SD_RES_EIO;
-				else
-					ret = SD_RES_SUCCESS;
-			} else
-				ret = SD_RES_SUCCESS;
-			goto out;
+		if (attr_matches(&tmp_attr, vattr)) {
+			attr_index_insert(vid, hval, *attrid);
+			goto found;
 		}
 
 		(*attrid)++;
@@ -701,6 +1730,11 @@ int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len,
 
 	dprintf("there is no space for new VDIs\n");
 	ret = SD_RES_FULL_VDI;
+	goto out;
+found:
+	ret = update_vdi_attr(vattr, oid, wr, excl, delete);
+	if (delete && ret == SD_RES_SUCCESS)
+		attr_index_remove(vid, hval);
 out:
 	return ret;
 }
@@ -24,3 +24,105 @@ def test_create_vdi():
     p = n.run_collie('vdi list -r')
     (out, _) = p.communicate()
     assert len(out.splitlines()) == nr_vdis
+
+
+def test_vdi_flatten():
+    """Flatten a clone and check that it keeps its data on its own."""
+
+    size = 2 * 4 * 1024 ** 2
+    sdog = Sheepdog()
+
+    for n in sdog.nodes:
+        n.start()
+        n.wait()
+
+    p = sdog.format()
+    p.wait()
+
+    vdi = sdog.create_vdi('base', 64 * 1024 ** 2)
+    vdi.wait()
+
+    # fill the first two data objects of the base image
+    data = ''.join([chr(i % 251) for i in range(size)])
+    p = Popen([collie_path, 'vdi', 'write', 'base', '0', str(size),
+               '-p', str(n.get_port())], stdin=PIPE)
+    p.communicate(data)
+    assert p.returncode == 0
+
+    n.run_collie('vdi snapshot -s snap base').wait()
+    n.run_collie('vdi clone -s snap base clone').wait()
+
+    p = n.run_collie('vdi flatten clone')
+    p.wait()
+    assert p.returncode == 0
+
+    p = n.run_collie('vdi read clone 0 %d' % size)
+    (out, _) = p.communicate()
+    assert out == data
+
+    p = n.run_collie('vdi object clone')
+    (out, _) = p.communicate()
+    vid = int(re.search(r'inode object 0x([0-9a-f]+)', out).group(1), 16)
+
+    # the data objects now belong to the clone, not to the snapshot
+    for idx in range(2):
+        p = n.run_collie('vdi object -i %d clone' % idx)
+        (out, _) = p.communicate()
+        oid = int(re.search(r'Looking for the object 0x([0-9a-f]+)',
+                            out).group(1), 16)
+        assert oid >> 32 == vid
+
+    for n in sdog.nodes:
+        n.stop()
+
+
+def test_vdi_attr():
+    """Set, get and delete VDI attributes."""
+
+    nr_attrs = 10
+    sdog = Sheepdog()
+
+    for n in sdog.nodes:
+        n.start()
+        n.wait()
+
+    p = sdog.format()
+    p.wait()
+
+    vdi = sdog.create_vdi('attr', 4 * 1024 ** 3)
+    vdi.wait()
+
+    for i in range(nr_attrs):
+        p = n.run_collie('vdi setattr attr key%d value%d' % (i, i))
+        p.wait()
+        assert p.returncode == 0
+
+    # creating an existing attribute exclusively fails
+    p = n.run_collie('vdi setattr -x attr key0 other')
+    p.wait()
+    assert p.returncode != 0
+
+    for i in range(nr_attrs):
+        p = n.run_collie('vdi getattr attr key%d' % i)
+        (out, _) = p.communicate()
+        assert p.returncode == 0
+        assert out.rstrip('\0') == 'value%d' % i
+
+    p = n.run_collie('vdi setattr -d attr key3')
+    p.wait()
+    assert p.returncode == 0
+
+    p = n.run_collie('vdi getattr attr key3')
+    p.communicate()
+    assert p.returncode != 0
+
+    # the others are still found after the deletion
+    for i in range(nr_attrs):
+        if i == 3:
+            continue
+        p = n.run_collie('vdi getattr attr key%d' % i)
+        (out, _) = p.communicate()
+        assert out.rstrip('\0') == 'value%d' % i
+
+    for n in sdog.nodes:
+        n.stop()